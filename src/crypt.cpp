@@ -0,0 +1,121 @@
+#include "crypt.h"
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+#include <cstring>
+
+/* cost of deriving a key with scrypt. This takes around a tenth of a second
+ * and 32MB of memory */
+#define SCRYPT_N                (1 << 15)
+#define SCRYPT_R                8
+#define SCRYPT_P                1
+#define SCRYPT_MAX_MEMORY       (64 << 20)
+
+#define NONCE_BYTES             12
+
+/* the nonce of a frame is its number, big endian, padded out with zeroes.
+ * Every image gets a key of its own from its salt, so numbering the frames
+ * from zero never reuses a nonce under the same key */
+static void
+frame_nonce ( const Cipher &cipher, BYTE *nonce ) {
+    LONG frame = cipher.frame;
+    for( int i=NONCE_BYTES-1; i>=0; i--, frame >>= BYTES_TO_BITS(1) ) {
+        nonce[i] = frame;
+    }
+}
+
+bool
+random_salt ( BYTE *salt ) {
+    return RAND_bytes( salt, SALT_BYTES ) == 1;
+}
+
+bool
+derive_keys ( const std::string &passphrase, const BYTE *salt,
+        BYTE *keys, size_t n ) {
+    return EVP_PBE_scrypt( passphrase.data(), passphrase.length(),
+            salt, SALT_BYTES, SCRYPT_N, SCRYPT_R, SCRYPT_P,
+            SCRYPT_MAX_MEMORY, keys, n ) == 1;
+}
+
+bool
+open_cipher ( Cipher &cipher, const BYTE *key ) {
+    cipher.frame = 0;
+    cipher.ctx   = EVP_CIPHER_CTX_new();
+    memcpy( cipher.key, key, CIPHER_KEY_BYTES );
+    return cipher.ctx != NULL;
+}
+
+bool
+seal_frame ( Cipher &cipher, const BYTE *data, size_t n, bool last,
+        BYTE *out ) {
+    BYTE nonce[NONCE_BYTES];
+    uint32_t length = n | (last? FRAME_LAST : 0);
+    int len;
+
+    for( int i=FRAME_LENGTH_BYTES-1; i>=0; i-- ) {
+        out[i] = length;
+        length >>= BYTES_TO_BITS(1);
+    }
+    frame_nonce( cipher, nonce );
+    cipher.frame++;
+
+    BYTE *ciphertext = out + FRAME_LENGTH_BYTES;
+    return EVP_EncryptInit_ex( cipher.ctx, EVP_chacha20_poly1305(), NULL,
+                cipher.key, nonce ) == 1 &&
+        EVP_EncryptUpdate( cipher.ctx, NULL, &len, out,
+                FRAME_LENGTH_BYTES ) == 1 &&
+        EVP_EncryptUpdate( cipher.ctx, ciphertext, &len, data, n ) == 1 &&
+        EVP_EncryptFinal_ex( cipher.ctx, ciphertext + n, &len ) == 1 &&
+        EVP_CIPHER_CTX_ctrl( cipher.ctx, EVP_CTRL_AEAD_GET_TAG,
+                FRAME_TAG_BYTES, ciphertext + n ) == 1;
+}
+
+size_t
+frame_length ( const BYTE *frame, bool &last ) {
+    uint32_t length = 0;
+    for( int i=0; i<FRAME_LENGTH_BYTES; i++ ) {
+        length = (length << BYTES_TO_BITS(1)) | frame[i];
+    }
+    last = (length & FRAME_LAST) != 0;
+    return length & ~FRAME_LAST;
+}
+
+bool
+open_frame ( Cipher &cipher, const BYTE *frame, BYTE *out ) {
+    BYTE nonce[NONCE_BYTES];
+    bool last;
+    size_t n = frame_length( frame, last );
+    int len;
+
+    if( n > FRAME_DATA ) {
+        return false;
+    }
+    frame_nonce( cipher, nonce );
+    cipher.frame++;
+
+    /* the tag is handed over before decrypting, and checked at the end */
+    const BYTE *ciphertext = frame + FRAME_LENGTH_BYTES;
+    return EVP_DecryptInit_ex( cipher.ctx, EVP_chacha20_poly1305(), NULL,
+                cipher.key, nonce ) == 1 &&
+        EVP_CIPHER_CTX_ctrl( cipher.ctx, EVP_CTRL_AEAD_SET_TAG,
+                FRAME_TAG_BYTES, (void *) (ciphertext + n) ) == 1 &&
+        EVP_DecryptUpdate( cipher.ctx, NULL, &len, frame,
+                FRAME_LENGTH_BYTES ) == 1 &&
+        EVP_DecryptUpdate( cipher.ctx, out, &len, ciphertext, n ) == 1 &&
+        EVP_DecryptFinal_ex( cipher.ctx, out + n, &len ) == 1;
+}
+
+LONG
+sealed_size ( LONG n ) {
+    /* every frame but the last is full, and the last may be empty */
+    return n + (n / FRAME_DATA + 1) * FRAME_OVERHEAD;
+}
+
+void
+close_cipher ( Cipher &cipher ) {
+    OPENSSL_cleanse( cipher.key, sizeof(cipher.key) );
+    if( cipher.ctx ) {
+        EVP_CIPHER_CTX_free( cipher.ctx );
+        cipher.ctx = NULL;
+    }
+}
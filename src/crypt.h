@@ -0,0 +1,64 @@
+#ifndef CRYPT_H
+#define CRYPT_H
+
+#include "steg.h"
+#include <string>
+
+/* files may be encrypted with ChaCha20-Poly1305 before they are embedded,
+ * under a key derived from a passphrase and a random salt with scrypt. The
+ * encrypted data is cut into frames which are each authenticated on their
+ * own, so a file can be decrypted a frame at a time as it is retrieved and
+ * nothing is handed out before it has been checked. A frame is a 4 byte
+ * length, followed by that many bytes of ciphertext and then the tag. The
+ * top bit of the length marks the last frame. The length is authenticated
+ * along with the ciphertext and the number of the frame makes up the nonce,
+ * so frames can't be altered, dropped, reordered or cut short unnoticed */
+#define SALT_BYTES              16
+#define FRAME_DATA              (1 << 16)
+#define FRAME_LENGTH_BYTES      4
+#define FRAME_TAG_BYTES         16
+#define FRAME_OVERHEAD          (FRAME_LENGTH_BYTES + FRAME_TAG_BYTES)
+#define FRAME_LAST              0x80000000
+#define CIPHER_KEY_BYTES        32
+
+struct evp_cipher_ctx_st;
+
+struct Cipher {
+    evp_cipher_ctx_st *ctx = NULL;
+    BYTE key[CIPHER_KEY_BYTES];
+    LONG frame;         /* number of the next frame */
+};
+
+/* fill a salt with random bytes. Returns false if no randomness could be
+ * had */
+bool random_salt ( BYTE *salt );
+
+/* derive n bytes of keys from a passphrase and salt. Returns false if they
+ * could not be derived */
+bool derive_keys ( const std::string &passphrase, const BYTE *salt,
+        BYTE *keys, size_t n );
+
+/* set up a cipher to seal or open frames under a key of CIPHER_KEY_BYTES
+ * bytes, starting from the first frame. Returns false on failure */
+bool open_cipher ( Cipher &cipher, const BYTE *key );
+
+/* seal n bytes of data, no more than FRAME_DATA, into the next frame, which
+ * is written to out. out must have room for n + FRAME_OVERHEAD bytes.
+ * Returns false if the data could not be sealed */
+bool seal_frame ( Cipher &cipher, const BYTE *data, size_t n, bool last,
+        BYTE *out );
+
+/* length of the data held in a frame, from the length at its start, and
+ * whether it is the last frame */
+size_t frame_length ( const BYTE *frame, bool &last );
+
+/* open the next frame, writing the frame_length() bytes of data it holds to
+ * out. Returns false if the frame is not authentic */
+bool open_frame ( Cipher &cipher, const BYTE *frame, BYTE *out );
+
+/* number of bytes n bytes of data take up once sealed into frames */
+LONG sealed_size ( LONG n );
+
+void close_cipher ( Cipher &cipher );
+
+#endif
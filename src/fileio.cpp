@@ -0,0 +1,285 @@
+#include "fileio.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <algorithm>
+#ifdef __linux__
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+bool
+open_payload ( Payload &payload, const char *filename ) {
+    struct stat st;
+
+    if( stat( filename, &st ) < 0 ) {
+        return false;
+    }
+    return open_payload_part( payload, filename, 0, st.st_size );
+}
+
+bool
+open_payload_part ( Payload &payload, const char *filename, LONG start,
+        LONG size ) {
+    struct stat st;
+
+    payload.fd = open( filename, O_RDONLY );
+    if( payload.fd < 0 ) {
+        return false;
+    }
+
+    if( fstat( payload.fd, &st ) < 0 || !S_ISREG( st.st_mode ) ||
+            start > (LONG) st.st_size || size > st.st_size - start ) {
+        close_payload( payload );
+        return false;
+    }
+
+    payload.start    = start;
+    payload.size     = size;
+    payload.offset   = 0;
+    payload.slack    = start % sysconf( _SC_PAGESIZE );
+    payload.released = 0;
+
+    /* map the file so that its pages can be packed into the image without
+     * first being copied into a buffer. A mapping has to begin on a page, so
+     * it takes in the slack before the start of the part. Empty files can't
+     * be mapped and need no reading anyway */
+    if( payload.size ) {
+        void *map = mmap( NULL, payload.slack + payload.size, PROT_READ, 
+                MAP_PRIVATE, payload.fd, start - payload.slack );
+        if( map != MAP_FAILED ) {
+            payload.map = (const BYTE *) map + payload.slack;
+            madvise( map, payload.slack + payload.size, MADV_SEQUENTIAL );
+            return true;
+        }
+    }
+
+    /* the file is read once from start to finish, so let the kernel read
+     * well ahead of us */
+    posix_fadvise( payload.fd, start, size, POSIX_FADV_SEQUENTIAL );
+    return true;
+}
+
+size_t
+read_block ( Payload &payload, std::vector<BYTE> &buffer, size_t max,
+        const BYTE *&data ) {
+    size_t want = std::min( (LONG) max, payload.size - payload.offset );
+    size_t got  = 0;
+
+    if( payload.map ) {
+        /* everything handed out before this call has been packed into the
+         * image. Give those pages back so that mapping a huge file doesn't
+         * pin all of it in memory */
+        const BYTE *base = payload.map - payload.slack;
+        long page = sysconf( _SC_PAGESIZE );
+        LONG done = payload.slack + payload.offset;
+        done -= done % page;
+        if( done > payload.released ) {
+            madvise( (void *) (base + payload.released), 
+                    done - payload.released, MADV_DONTNEED );
+            payload.released = done;
+        }
+
+        data = payload.map + payload.offset;
+        payload.offset += want;
+        return want;
+    }
+
+    while( got < want ) {
+        ssize_t n = pread( payload.fd, buffer.data() + got, want - got,
+                payload.start + payload.offset + got );
+        if( n < 0 && errno == EINTR ) {
+            continue;
+        }
+        if( n <= 0 ) {
+            return 0;
+        }
+        got += n;
+    }
+
+    payload.offset += got;
+    data = buffer.data();
+    return got;
+}
+
+void
+close_payload ( Payload &payload ) {
+    if( payload.map ) {
+        munmap( (void *) (payload.map - payload.slack), 
+                payload.slack + payload.size );
+        payload.map = NULL;
+    }
+    if( payload.fd >= 0 ) {
+        close( payload.fd );
+        payload.fd = -1;
+    }
+}
+
+int
+create_output ( const char *filename, LONG size ) {
+    int fd = open( filename, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+    if( fd < 0 ) {
+        return -1;
+    }
+
+    /* reserving the space up front lets the filesystem lay the file out in
+     * one piece. Not every filesystem supports this, which is harmless */
+#ifdef FALLOC_FL_KEEP_SIZE
+    if( size ) {
+        fallocate( fd, FALLOC_FL_KEEP_SIZE, 0, size );
+    }
+#endif
+    return fd;
+}
+
+int
+open_output_part ( const char *filename, LONG offset ) {
+    int fd = open( filename, O_WRONLY | O_CREAT, 0666 );
+    if( fd < 0 ) {
+        return -1;
+    }
+    if( lseek( fd, offset, SEEK_SET ) < 0 ) {
+        close( fd );
+        return -1;
+    }
+    return fd;
+}
+
+int
+open_input ( const char *filename ) {
+    return open( filename, O_RDONLY );
+}
+
+int
+open_update ( const char *filename ) {
+    return open( filename, O_RDWR );
+}
+
+bool
+read_at ( int fd, BYTE *data, size_t n, LONG offset ) {
+    while( n ) {
+        ssize_t got = pread( fd, data, n, offset );
+        if( got < 0 && errno == EINTR ) {
+            continue;
+        }
+        if( got <= 0 ) {
+            return false;
+        }
+        data   += got;
+        n      -= got;
+        offset += got;
+    }
+    return true;
+}
+
+bool
+write_at ( int fd, const BYTE *data, size_t n, LONG offset ) {
+    while( n ) {
+        ssize_t written = pwrite( fd, data, n, offset );
+        if( written < 0 && errno == EINTR ) {
+            continue;
+        }
+        if( written <= 0 ) {
+            return false;
+        }
+        data   += written;
+        n      -= written;
+        offset += written;
+    }
+    return true;
+}
+
+bool
+truncate_output ( int fd, LONG size ) {
+    return ftruncate( fd, size ) == 0;
+}
+
+bool
+write_fully ( int fd, const BYTE *data, size_t n ) {
+    while( n ) {
+        ssize_t written = write( fd, data, n );
+        if( written < 0 && errno == EINTR ) {
+            continue;
+        }
+        if( written <= 0 ) {
+            return false;
+        }
+        data += written;
+        n    -= written;
+    }
+    return true;
+}
+
+void
+close_input ( int fd ) {
+    if( fd >= 0 ) {
+        close( fd );
+    }
+}
+
+bool
+close_output ( int fd ) {
+    return close( fd ) == 0;
+}
+
+bool
+copy_file ( const char *from, const char *to ) {
+    struct stat st;
+    int in = open( from, O_RDONLY );
+    if( in < 0 ) {
+        return false;
+    }
+    if( fstat( in, &st ) < 0 ) {
+        close( in );
+        return false;
+    }
+
+    int out = create_output( to, 0 );
+    if( out < 0 ) {
+        close( in );
+        return false;
+    }
+
+    /* on filesystems which support it, the copy simply shares the blocks of
+     * the original until either is changed, however large the file */
+    LONG done = 0;
+#ifdef FICLONE
+    if( ioctl( out, FICLONE, in ) == 0 ) {
+        done = st.st_size;
+    }
+#endif
+
+    /* copy_file_range() may copy less than asked, and is not supported
+     * between every pair of filesystems, in which case the copy is carried
+     * on through a buffer */
+    while( done < (LONG) st.st_size ) {
+        ssize_t n = copy_file_range( in, NULL, out, NULL, 
+                st.st_size - done, 0 );
+        if( n < 0 && errno == EINTR ) {
+            continue;
+        }
+        if( n <= 0 ) {
+            break;
+        }
+        done += n;
+    }
+
+    std::vector<BYTE> buffer;
+    while( done < (LONG) st.st_size ) {
+        buffer.resize( 1 << 20 );
+        ssize_t n = pread( in, buffer.data(), buffer.size(), done );
+        if( n < 0 && errno == EINTR ) {
+            continue;
+        }
+        if( n <= 0 || !write_fully( out, buffer.data(), n ) ) {
+            break;
+        }
+        done += n;
+    }
+
+    close( in );
+    return close_output( out ) && done == (LONG) st.st_size;
+}
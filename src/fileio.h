@@ -0,0 +1,77 @@
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include "steg.h"
+#include <vector>
+
+/* a file being embedded in an image. Where possible the file is mapped into
+ * memory and its contents handed out in place. Otherwise they are read in 
+ * large blocks straight from the file descriptor, bypassing iostreams */
+struct Payload {
+    int  fd = -1;
+    LONG start;             /* offset within the file of the first byte */
+    LONG size;              /* number of bytes to be handed out */
+    LONG offset;            /* number of bytes handed out so far */
+    const BYTE *map = NULL; /* the mapped file, if it could be mapped */
+    LONG slack;             /* bytes mapped before map to align it to a page */
+    LONG released;          /* mapped bytes already given back to the OS */
+};
+
+/* open a file to be embedded. Returns false if it can't be opened */
+bool open_payload ( Payload &payload, const char *filename );
+
+/* open part of a file to be embedded: size bytes from start on, which are
+ * handed out as though they were the whole file. Returns false if the file
+ * can't be opened or is too short */
+bool open_payload_part ( Payload &payload, const char *filename, LONG start,
+        LONG size );
+
+/* hand out the next block of the file, of at most max bytes. data is set to
+ * point at the block, which is either in the mapping or read into the buffer
+ * (which must hold at least max bytes), and stays valid until the next call.
+ * Returns the number of bytes in the block, which is zero at the end of the
+ * file or if it can't be read */
+size_t read_block ( Payload &payload, std::vector<BYTE> &buffer, size_t max,
+        const BYTE *&data );
+
+void close_payload ( Payload &payload );
+
+/* create (or truncate) a file to hold retrieved data, sized up front to the
+ * number of bytes about to be written. Returns -1 on failure */
+int create_output ( const char *filename, LONG size );
+
+/* open a file to write part of the retrieved data into, starting at offset
+ * and leaving the rest of the file as it is. The file is created if it
+ * doesn't exist. Returns -1 on failure */
+int open_output_part ( const char *filename, LONG offset );
+
+/* open an existing file to read parts of it, or to read and write parts of
+ * it in place. Returns -1 on failure */
+int open_input ( const char *filename );
+int open_update ( const char *filename );
+
+/* read or write n bytes at the given offset in a file. Returns false if the
+ * whole buffer couldn't be read or written */
+bool read_at ( int fd, BYTE *data, size_t n, LONG offset );
+bool write_at ( int fd, const BYTE *data, size_t n, LONG offset );
+
+/* cut a file down to size bytes. Returns false on failure */
+bool truncate_output ( int fd, LONG size );
+
+/* write a buffer to a file descriptor in as few calls as possible. Returns
+ * false if the whole buffer couldn't be written */
+bool write_fully ( int fd, const BYTE *data, size_t n );
+
+/* close a file opened by open_input(). Does nothing if fd is -1 */
+void close_input ( int fd );
+
+/* close a file created by create_output(). Returns false if any of the data
+ * failed to make it to the file */
+bool close_output ( int fd );
+
+/* copy a file, leaving the kernel to move the data (or share it, on
+ * filesystems which support that) without it passing through user space.
+ * Returns false if the copy could not be made */
+bool copy_file ( const char *from, const char *to );
+
+#endif
@@ -0,0 +1,724 @@
+#include "steg.h"
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+/* embed a run of bytes in the consecutive channels starting at dst. Every
+ * byte occupies a fixed number of channels, so the position of each bit is
+ * known up front and no per-bit bookkeeping is required */
+static void
+pack_bytes_scalar ( CHANNEL *dst, const BYTE *src, size_t n ) {
+    const int per_byte = CHANNELS_TO_ENCODE(sizeof(BYTE));
+
+    for( size_t i=0; i<n; i++, dst+=per_byte ) {
+        BYTE b = src[i];
+        for( int j=0; j<per_byte; j++ ) {
+            dst[j] = (dst[j] & ~CHANNEL_BIT_MASK) | 
+                ((b >> ((per_byte-1-j)*ENCODE_BITS_PER_CHANNEL)) & 
+                 CHANNEL_BIT_MASK);
+        }
+    }
+}
+
+/* retrieve a run of bytes from the consecutive channels starting at src */
+static void
+unpack_bytes_scalar ( BYTE *dst, const CHANNEL *src, size_t n ) {
+    const int per_byte = CHANNELS_TO_ENCODE(sizeof(BYTE));
+
+    for( size_t i=0; i<n; i++, src+=per_byte ) {
+        BYTE b = 0;
+        for( int j=0; j<per_byte; j++ ) {
+            b = (b << ENCODE_BITS_PER_CHANNEL) | (src[j] & CHANNEL_BIT_MASK);
+        }
+        dst[i] = b;
+    }
+}
+
+#if defined(HAVE_X86_KERNELS) && ENCODE_BITS_PER_CHANNEL == 2
+
+/* The vector kernels below all work the same way. When packing, each payload
+ * byte b is widened into a 32 bit lane and its four 2 bit chunks are shifted
+ * into the low bits of the lane's four bytes, most significant chunk first:
+ *
+ *     lane = (b >> 6) | (b << 4 & 0x300) | (b << 14 & 0x30000) | (b << 24)
+ *
+ * which is then merged into four channels with a single mask and or. Unpacking
+ * runs the same shifts backwards to gather the chunks into the low byte of
+ * each lane, and the lanes are then narrowed back down to bytes */
+
+#define LANE_CHUNK_1  0x00000300
+#define LANE_CHUNK_2  0x00030000
+#define LANE_CHUNK_3  0x03000000
+#define LANE_BITS_0   0x000000C0
+#define LANE_BITS_1   0x00000030
+#define LANE_BITS_2   0x0000000C
+#define CHANNEL_KEEP  ((int) 0xFCFCFCFC)
+#define CHANNEL_BITS  0x03030303
+
+static inline __m128i
+spread_sse2 ( __m128i b ) {
+    __m128i r = _mm_srli_epi32( b, 6 );
+    r = _mm_or_si128( r, _mm_and_si128( _mm_slli_epi32( b, 4 ), 
+                _mm_set1_epi32( LANE_CHUNK_1 ) ) );
+    r = _mm_or_si128( r, _mm_and_si128( _mm_slli_epi32( b, 14 ), 
+                _mm_set1_epi32( LANE_CHUNK_2 ) ) );
+    r = _mm_or_si128( r, _mm_and_si128( _mm_slli_epi32( b, 24 ), 
+                _mm_set1_epi32( LANE_CHUNK_3 ) ) );
+    return r;
+}
+
+static inline __m128i
+gather_sse2 ( __m128i c ) {
+    c = _mm_and_si128( c, _mm_set1_epi32( CHANNEL_BITS ) );
+    __m128i r = _mm_srli_epi32( c, 24 );
+    r = _mm_or_si128( r, _mm_and_si128( _mm_slli_epi32( c, 6 ), 
+                _mm_set1_epi32( LANE_BITS_0 ) ) );
+    r = _mm_or_si128( r, _mm_and_si128( _mm_srli_epi32( c, 4 ), 
+                _mm_set1_epi32( LANE_BITS_1 ) ) );
+    r = _mm_or_si128( r, _mm_and_si128( _mm_srli_epi32( c, 14 ), 
+                _mm_set1_epi32( LANE_BITS_2 ) ) );
+    return r;
+}
+
+/* 16 bytes into 64 channels per iteration */
+static void
+pack_bytes_sse2 ( CHANNEL *dst, const BYTE *src, size_t n ) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i keep = _mm_set1_epi32( CHANNEL_KEEP );
+    size_t i = 0;
+
+    for( ; i+16<=n; i+=16, dst+=64 ) {
+        __m128i in = _mm_loadu_si128( (const __m128i *) (src + i) );
+        __m128i lo = _mm_unpacklo_epi8( in, zero );
+        __m128i hi = _mm_unpackhi_epi8( in, zero );
+        __m128i b[4] = {
+            _mm_unpacklo_epi16( lo, zero ), _mm_unpackhi_epi16( lo, zero ),
+            _mm_unpacklo_epi16( hi, zero ), _mm_unpackhi_epi16( hi, zero )
+        };
+
+        for( int k=0; k<4; k++ ) {
+            __m128i *p = (__m128i *) (dst + 16*k);
+            __m128i d = _mm_and_si128( _mm_loadu_si128( p ), keep );
+            _mm_storeu_si128( p, _mm_or_si128( d, spread_sse2( b[k] ) ) );
+        }
+    }
+
+    pack_bytes_scalar( dst, src + i, n - i );
+}
+
+/* 64 channels into 16 bytes per iteration */
+static void
+unpack_bytes_sse2 ( BYTE *dst, const CHANNEL *src, size_t n ) {
+    size_t i = 0;
+
+    for( ; i+16<=n; i+=16, src+=64 ) {
+        __m128i g[4];
+        for( int k=0; k<4; k++ ) {
+            g[k] = gather_sse2( 
+                    _mm_loadu_si128( (const __m128i *) (src + 16*k) ) );
+        }
+
+        __m128i out = _mm_packus_epi16( _mm_packs_epi32( g[0], g[1] ),
+                _mm_packs_epi32( g[2], g[3] ) );
+        _mm_storeu_si128( (__m128i *) (dst + i), out );
+    }
+
+    unpack_bytes_scalar( dst + i, src, n - i );
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+spread_avx2 ( __m256i b ) {
+    __m256i r = _mm256_srli_epi32( b, 6 );
+    r = _mm256_or_si256( r, _mm256_and_si256( _mm256_slli_epi32( b, 4 ), 
+                _mm256_set1_epi32( LANE_CHUNK_1 ) ) );
+    r = _mm256_or_si256( r, _mm256_and_si256( _mm256_slli_epi32( b, 14 ), 
+                _mm256_set1_epi32( LANE_CHUNK_2 ) ) );
+    r = _mm256_or_si256( r, _mm256_and_si256( _mm256_slli_epi32( b, 24 ), 
+                _mm256_set1_epi32( LANE_CHUNK_3 ) ) );
+    return r;
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+gather_avx2 ( __m256i c ) {
+    c = _mm256_and_si256( c, _mm256_set1_epi32( CHANNEL_BITS ) );
+    __m256i r = _mm256_srli_epi32( c, 24 );
+    r = _mm256_or_si256( r, _mm256_and_si256( _mm256_slli_epi32( c, 6 ), 
+                _mm256_set1_epi32( LANE_BITS_0 ) ) );
+    r = _mm256_or_si256( r, _mm256_and_si256( _mm256_srli_epi32( c, 4 ), 
+                _mm256_set1_epi32( LANE_BITS_1 ) ) );
+    r = _mm256_or_si256( r, _mm256_and_si256( _mm256_srli_epi32( c, 14 ), 
+                _mm256_set1_epi32( LANE_BITS_2 ) ) );
+    return r;
+}
+
+/* 32 bytes into 128 channels per iteration */
+__attribute__((target("avx2"))) static void
+pack_bytes_avx2 ( CHANNEL *dst, const BYTE *src, size_t n ) {
+    const __m256i keep = _mm256_set1_epi32( CHANNEL_KEEP );
+    size_t i = 0;
+
+    for( ; i+32<=n; i+=32, dst+=128 ) {
+        for( int k=0; k<4; k++ ) {
+            __m256i b = _mm256_cvtepu8_epi32( 
+                    _mm_loadl_epi64( (const __m128i *) (src + i + 8*k) ) );
+            __m256i *p = (__m256i *) (dst + 32*k);
+            __m256i d = _mm256_and_si256( _mm256_loadu_si256( p ), keep );
+            _mm256_storeu_si256( p, _mm256_or_si256( d, spread_avx2( b ) ) );
+        }
+    }
+
+    pack_bytes_sse2( dst, src + i, n - i );
+}
+
+/* 128 channels into 32 bytes per iteration. The pack instructions work
+ * within 128 bit halves, so the result is put back in order with a final
+ * permute */
+__attribute__((target("avx2"))) static void
+unpack_bytes_avx2 ( BYTE *dst, const CHANNEL *src, size_t n ) {
+    const __m256i order = _mm256_setr_epi32( 0, 4, 1, 5, 2, 6, 3, 7 );
+    size_t i = 0;
+
+    for( ; i+32<=n; i+=32, src+=128 ) {
+        __m256i g[4];
+        for( int k=0; k<4; k++ ) {
+            g[k] = gather_avx2( 
+                    _mm256_loadu_si256( (const __m256i *) (src + 32*k) ) );
+        }
+
+        __m256i out = _mm256_packus_epi16( _mm256_packs_epi32( g[0], g[1] ),
+                _mm256_packs_epi32( g[2], g[3] ) );
+        out = _mm256_permutevar8x32_epi32( out, order );
+        _mm256_storeu_si256( (__m256i *) (dst + i), out );
+    }
+
+    unpack_bytes_sse2( dst + i, src, n - i );
+}
+
+/* the plain forms of the AVX-512 shifts and conversions are built on the
+ * masked ones, fed a vector which GCC deliberately leaves undefined (and
+ * then warns about). Zero masking every lane gives the same instructions
+ * without one */
+#define ALL_LANES ((__mmask16) 0xFFFF)
+
+__attribute__((target("avx512f"))) static inline __m512i
+spread_avx512 ( __m512i b ) {
+    __m512i r = _mm512_maskz_srli_epi32( ALL_LANES, b, 6 );
+    r = _mm512_or_si512( r, _mm512_and_si512( 
+                _mm512_maskz_slli_epi32( ALL_LANES, b, 4 ), 
+                _mm512_set1_epi32( LANE_CHUNK_1 ) ) );
+    r = _mm512_or_si512( r, _mm512_and_si512( 
+                _mm512_maskz_slli_epi32( ALL_LANES, b, 14 ), 
+                _mm512_set1_epi32( LANE_CHUNK_2 ) ) );
+    r = _mm512_or_si512( r, _mm512_and_si512( 
+                _mm512_maskz_slli_epi32( ALL_LANES, b, 24 ), 
+                _mm512_set1_epi32( LANE_CHUNK_3 ) ) );
+    return r;
+}
+
+__attribute__((target("avx512f"))) static inline __m512i
+gather_avx512 ( __m512i c ) {
+    c = _mm512_and_si512( c, _mm512_set1_epi32( CHANNEL_BITS ) );
+    __m512i r = _mm512_maskz_srli_epi32( ALL_LANES, c, 24 );
+    r = _mm512_or_si512( r, _mm512_and_si512( 
+                _mm512_maskz_slli_epi32( ALL_LANES, c, 6 ), 
+                _mm512_set1_epi32( LANE_BITS_0 ) ) );
+    r = _mm512_or_si512( r, _mm512_and_si512( 
+                _mm512_maskz_srli_epi32( ALL_LANES, c, 4 ), 
+                _mm512_set1_epi32( LANE_BITS_1 ) ) );
+    r = _mm512_or_si512( r, _mm512_and_si512( 
+                _mm512_maskz_srli_epi32( ALL_LANES, c, 14 ), 
+                _mm512_set1_epi32( LANE_BITS_2 ) ) );
+    return r;
+}
+
+/* 64 bytes into 256 channels per iteration. The merge of the new chunks into
+ * the existing channels is a single ternary logic instruction computing
+ * (channel & keep) | chunks */
+__attribute__((target("avx512f"))) static void
+pack_bytes_avx512 ( CHANNEL *dst, const BYTE *src, size_t n ) {
+    const __m512i keep = _mm512_set1_epi32( CHANNEL_KEEP );
+    size_t i = 0;
+
+    for( ; i+64<=n; i+=64, dst+=256 ) {
+        for( int k=0; k<4; k++ ) {
+            __m512i b = _mm512_maskz_cvtepu8_epi32( ALL_LANES,
+                    _mm_loadu_si128( (const __m128i *) (src + i + 16*k) ) );
+            CHANNEL *p = dst + 64*k;
+            __m512i d = _mm512_loadu_si512( p );
+            _mm512_storeu_si512( p, 
+                    _mm512_ternarylogic_epi32( d, keep, spread_avx512( b ), 
+                        0xEA ) );
+        }
+    }
+
+    pack_bytes_avx2( dst, src + i, n - i );
+}
+
+/* 256 channels into 64 bytes per iteration. Each vector of gathered lanes is
+ * narrowed straight down to bytes */
+__attribute__((target("avx512f"))) static void
+unpack_bytes_avx512 ( BYTE *dst, const CHANNEL *src, size_t n ) {
+    size_t i = 0;
+
+    for( ; i+64<=n; i+=64, src+=256 ) {
+        for( int k=0; k<4; k++ ) {
+            __m512i g = gather_avx512( _mm512_loadu_si512( src + 64*k ) );
+            _mm_storeu_si128( (__m128i *) (dst + i + 16*k), 
+                    _mm512_maskz_cvtepi32_epi8( ALL_LANES, g ) );
+        }
+    }
+
+    unpack_bytes_avx2( dst + i, src, n - i );
+}
+
+#endif
+
+/* CRC32C (the Castagnoli polynomial, bit reversed), a byte at a time from a
+ * table filled in by init_kernels() */
+#define CRC32C_POLY 0x82F63B78
+
+static uint32_t crc32c_table[256];
+
+static void
+init_crc32c_table () {
+    for( uint32_t i=0; i<256; i++ ) {
+        uint32_t c = i;
+        for( int k=0; k<8; k++ ) {
+            c = (c >> 1) ^ ((c & 1)? CRC32C_POLY : 0);
+        }
+        crc32c_table[i] = c;
+    }
+}
+
+static uint32_t
+crc32c_scalar ( uint32_t crc, const BYTE *data, size_t n ) {
+    crc = ~crc;
+    for( size_t i=0; i<n; i++ ) {
+        crc = crc32c_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(HAVE_X86_KERNELS) && defined(__x86_64__)
+
+/* SSE4.2 has an instruction for CRC32C which takes 8 bytes at a time */
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42 ( uint32_t crc, const BYTE *data, size_t n ) {
+    uint64_t c = ~crc;
+
+    for( ; n && ((uintptr_t) data & 7); n--, data++ ) {
+        c = _mm_crc32_u8( c, *data );
+    }
+    for( ; n >= 8; n-=8, data+=8 ) {
+        uint64_t v;
+        __builtin_memcpy( &v, data, sizeof(v) );
+        c = _mm_crc32_u64( c, v );
+    }
+    for( ; n; n--, data++ ) {
+        c = _mm_crc32_u8( c, *data );
+    }
+    return ~(uint32_t) c;
+}
+
+#endif
+
+/* syndromes, a byte's worth of channels at a time. Positions are counted
+ * from a byte boundary one channel before the block, so that the position
+ * of every channel in a byte is the byte's offset with the channel's place
+ * in the byte in its low bits. The tables hold the exclusive or of the set
+ * places in a byte of least significant bits, and its parity, which says
+ * whether the offset itself is counted an odd number of times */
+static BYTE syndrome_table[256];
+static BYTE parity_table[256];
+
+static void
+init_syndrome_tables () {
+    for( int i=0; i<256; i++ ) {
+        for( int j=0; j<BYTES_TO_BITS(1); j++ ) {
+            if( i & (1 << j) ) {
+                syndrome_table[i] ^= j;
+                parity_table[i]   ^= 1;
+            }
+        }
+    }
+}
+
+static uint32_t
+syndrome_scalar ( const CHANNEL *src, size_t n ) {
+    uint32_t s = 0;
+
+    /* position 0 isn't part of the block */
+    for( size_t pos=0; pos<=n; pos+=BYTES_TO_BITS(1) ) {
+        unsigned lsbs = 0;
+        for( size_t j=0; j<BYTES_TO_BITS(1); j++ ) {
+            if( pos + j > 0 && pos + j <= n ) {
+                lsbs |= (src[pos + j - 1] & 1) << j;
+            }
+        }
+        s ^= syndrome_table[lsbs] ^ (parity_table[lsbs]? pos : 0);
+    }
+    return s;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* bit-sliced syndromes. The least significant bits of the block are gathered
+ * into 64 bit words, 16 channels at a time, with position p going to bit p %
+ * 64 of word p / 64. Bit b of the syndrome of a word is then the parity of
+ * the set bits at positions with bit b set, and the position of the word
+ * itself counts if the word has odd parity */
+static const uint64_t POSITION_BITS[6] = {
+    0xAAAAAAAAAAAAAAAAull, 0xCCCCCCCCCCCCCCCCull, 0xF0F0F0F0F0F0F0F0ull,
+    0xFF00FF00FF00FF00ull, 0xFFFF0000FFFF0000ull, 0xFFFFFFFF00000000ull
+};
+
+static inline uint32_t
+word_syndrome ( uint64_t w, uint32_t pos ) {
+    uint32_t s = __builtin_parityll( w )? pos : 0;
+    for( int b=0; b<6; b++ ) {
+        s ^= __builtin_parityll( w & POSITION_BITS[b] ) << b;
+    }
+    return s;
+}
+
+static uint32_t
+syndrome_sse2 ( const CHANNEL *src, size_t n ) {
+    uint64_t words[(MATRIX_CHANNELS(MAX_MATRIX_BITS) + 1) / 64 + 1] = { 0 };
+    size_t i = 0;
+
+    if( n > MATRIX_CHANNELS(MAX_MATRIX_BITS) ) {
+        return syndrome_scalar( src, n );
+    }
+
+    /* shifting each channel left by 7 puts its least significant bit where
+     * movemask picks it up */
+    for( ; i + 16 <= n; i += 16 ) {
+        __m128i c = _mm_loadu_si128( (const __m128i *) (src + i) );
+        uint64_t m = (uint16_t) _mm_movemask_epi8( _mm_slli_epi16( c, 7 ) );
+        size_t pos = i + 1;
+        words[pos / 64] |= m << (pos % 64);
+        if( pos % 64 > 64 - 16 ) {
+            words[pos / 64 + 1] |= m >> (64 - pos % 64);
+        }
+    }
+    for( ; i < n; i++ ) {
+        size_t pos = i + 1;
+        words[pos / 64] |= (uint64_t) (src[i] & 1) << (pos % 64);
+    }
+
+    uint32_t s = 0;
+    for( size_t w=0; w <= n / 64; w++ ) {
+        s ^= word_syndrome( words[w], w * 64 );
+    }
+    return s;
+}
+
+#endif
+
+/* arithmetic in GF(2^8) under the polynomial x^8 + x^4 + x^3 + x^2 + 1.
+ * Products are found by adding logarithms, the table of powers being long
+ * enough that the sum needn't be reduced */
+#define GF_POLY 0x11D
+
+static BYTE gf_exp_table[2*255];
+static BYTE gf_log_table[256];
+
+static void
+init_gf_tables () {
+    unsigned x = 1;
+    for( int i=0; i<255; i++ ) {
+        gf_exp_table[i] = gf_exp_table[i + 255] = x;
+        gf_log_table[x] = i;
+        x <<= 1;
+        if( x & 0x100 ) {
+            x ^= GF_POLY;
+        }
+    }
+}
+
+BYTE
+gf_mul ( BYTE a, BYTE b ) {
+    if( !a || !b ) {
+        return 0;
+    }
+    return gf_exp_table[gf_log_table[a] + gf_log_table[b]];
+}
+
+BYTE
+gf_inv ( BYTE a ) {
+    return gf_exp_table[255 - gf_log_table[a]];
+}
+
+/* multiplying by c distributes over the two nibbles of a byte, so c times
+ * any byte is the sum of two products looked up in tables of 16. Those are
+ * small enough to sit in a vector register, where a byte shuffle looks up
+ * a whole vector's worth of nibbles at once */
+static void
+gf_nibble_tables ( BYTE c, BYTE lo[16], BYTE hi[16] ) {
+    for( int x=0; x<16; x++ ) {
+        lo[x] = gf_mul( c, x );
+        hi[x] = gf_mul( c, x << 4 );
+    }
+}
+
+static void
+gf_mul_add_tail ( BYTE *dst, const BYTE *src, size_t n, const BYTE lo[16], 
+        const BYTE hi[16] ) {
+    for( size_t i=0; i<n; i++ ) {
+        dst[i] ^= lo[src[i] & 0x0F] ^ hi[src[i] >> 4];
+    }
+}
+
+static void
+gf_mul_add_scalar ( BYTE *dst, const BYTE *src, BYTE c, size_t n ) {
+    BYTE lo[16], hi[16];
+
+    if( !c ) {
+        return;
+    }
+    gf_nibble_tables( c, lo, hi );
+    gf_mul_add_tail( dst, src, n, lo, hi );
+}
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("ssse3"))) static void
+gf_mul_add_ssse3 ( BYTE *dst, const BYTE *src, BYTE c, size_t n ) {
+    BYTE lo[16], hi[16];
+    size_t i = 0;
+
+    if( !c ) {
+        return;
+    }
+    gf_nibble_tables( c, lo, hi );
+
+    const __m128i tlo  = _mm_loadu_si128( (const __m128i *) lo );
+    const __m128i thi  = _mm_loadu_si128( (const __m128i *) hi );
+    const __m128i mask = _mm_set1_epi8( 0x0F );
+    for( ; i + 16 <= n; i += 16 ) {
+        __m128i s = _mm_loadu_si128( (const __m128i *) (src + i) );
+        __m128i d = _mm_loadu_si128( (const __m128i *) (dst + i) );
+        __m128i p = _mm_xor_si128( 
+                _mm_shuffle_epi8( tlo, _mm_and_si128( s, mask ) ),
+                _mm_shuffle_epi8( thi, 
+                    _mm_and_si128( _mm_srli_epi16( s, 4 ), mask ) ) );
+        _mm_storeu_si128( (__m128i *) (dst + i), _mm_xor_si128( d, p ) );
+    }
+    gf_mul_add_tail( dst + i, src + i, n - i, lo, hi );
+}
+
+/* the AVX2 shuffle looks up each 128 bit lane in its own half of the table
+ * register, so the tables are repeated in both halves */
+__attribute__((target("avx2"))) static void
+gf_mul_add_avx2 ( BYTE *dst, const BYTE *src, BYTE c, size_t n ) {
+    BYTE lo[16], hi[16];
+    size_t i = 0;
+
+    if( !c ) {
+        return;
+    }
+    gf_nibble_tables( c, lo, hi );
+
+    const __m256i tlo  = _mm256_broadcastsi128_si256( 
+            _mm_loadu_si128( (const __m128i *) lo ) );
+    const __m256i thi  = _mm256_broadcastsi128_si256( 
+            _mm_loadu_si128( (const __m128i *) hi ) );
+    const __m256i mask = _mm256_set1_epi8( 0x0F );
+    for( ; i + 32 <= n; i += 32 ) {
+        __m256i s = _mm256_loadu_si256( (const __m256i *) (src + i) );
+        __m256i d = _mm256_loadu_si256( (const __m256i *) (dst + i) );
+        __m256i p = _mm256_xor_si256( 
+                _mm256_shuffle_epi8( tlo, _mm256_and_si256( s, mask ) ),
+                _mm256_shuffle_epi8( thi, 
+                    _mm256_and_si256( _mm256_srli_epi16( s, 4 ), mask ) ) );
+        _mm256_storeu_si256( (__m256i *) (dst + i), 
+                _mm256_xor_si256( d, p ) );
+    }
+    gf_mul_add_tail( dst + i, src + i, n - i, lo, hi );
+}
+
+#endif
+
+/* differences between the channels of two images, looked up in a table of
+ * 16. Any difference too big for the table takes its last entry, so the
+ * lookup is a single byte shuffle once clamped */
+#define DIFF_TABLE_LAST 15
+
+static void
+diff_channels_scalar ( CHANNEL *dst, const CHANNEL *a, const CHANNEL *b, 
+        const CHANNEL table[16], size_t n ) {
+    for( size_t i=0; i<n; i++ ) {
+        int d = (a[i] > b[i])? a[i] - b[i] : b[i] - a[i];
+        dst[i] = table[std::min( d, DIFF_TABLE_LAST )];
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* the absolute difference of unsigned bytes is the or of the two saturating
+ * differences, one of which is always zero */
+__attribute__((target("ssse3"))) static void
+diff_channels_ssse3 ( CHANNEL *dst, const CHANNEL *a, const CHANNEL *b, 
+        const CHANNEL table[16], size_t n ) {
+    const __m128i t    = _mm_loadu_si128( (const __m128i *) table );
+    const __m128i last = _mm_set1_epi8( DIFF_TABLE_LAST );
+    size_t i = 0;
+
+    for( ; i + 16 <= n; i += 16 ) {
+        __m128i x = _mm_loadu_si128( (const __m128i *) (a + i) );
+        __m128i y = _mm_loadu_si128( (const __m128i *) (b + i) );
+        __m128i d = _mm_or_si128( _mm_subs_epu8( x, y ), 
+                _mm_subs_epu8( y, x ) );
+        _mm_storeu_si128( (__m128i *) (dst + i), 
+                _mm_shuffle_epi8( t, _mm_min_epu8( d, last ) ) );
+    }
+    diff_channels_scalar( dst + i, a + i, b + i, table, n - i );
+}
+
+__attribute__((target("avx2"))) static void
+diff_channels_avx2 ( CHANNEL *dst, const CHANNEL *a, const CHANNEL *b, 
+        const CHANNEL table[16], size_t n ) {
+    const __m256i t    = _mm256_broadcastsi128_si256( 
+            _mm_loadu_si128( (const __m128i *) table ) );
+    const __m256i last = _mm256_set1_epi8( DIFF_TABLE_LAST );
+    size_t i = 0;
+
+    for( ; i + 32 <= n; i += 32 ) {
+        __m256i x = _mm256_loadu_si256( (const __m256i *) (a + i) );
+        __m256i y = _mm256_loadu_si256( (const __m256i *) (b + i) );
+        __m256i d = _mm256_or_si256( _mm256_subs_epu8( x, y ), 
+                _mm256_subs_epu8( y, x ) );
+        _mm256_storeu_si256( (__m256i *) (dst + i), 
+                _mm256_shuffle_epi8( t, _mm256_min_epu8( d, last ) ) );
+    }
+    diff_channels_scalar( dst + i, a + i, b + i, table, n - i );
+}
+
+#endif
+
+void (*pack_bytes)   ( CHANNEL *, const BYTE *, size_t ) = pack_bytes_scalar;
+void (*unpack_bytes) ( BYTE *, const CHANNEL *, size_t ) = unpack_bytes_scalar;
+uint32_t (*crc32c)   ( uint32_t, const BYTE *, size_t ) = crc32c_scalar;
+uint32_t (*syndrome) ( const CHANNEL *, size_t ) = syndrome_scalar;
+void (*gf_mul_add)   ( BYTE *, const BYTE *, BYTE, size_t ) = gf_mul_add_scalar;
+void (*diff_channels) ( CHANNEL *, const CHANNEL *, const CHANNEL *, 
+        const CHANNEL *, size_t ) = diff_channels_scalar;
+
+void
+init_kernels () {
+    init_crc32c_table();
+    init_syndrome_tables();
+    init_gf_tables();
+
+#ifdef HAVE_X86_KERNELS
+    /* __builtin_cpu_supports() consults cpuid, along with whether the OS
+     * saves the wider registers across context switches */
+    __builtin_cpu_init();
+#endif
+
+#ifdef HAVE_X86_KERNELS
+    if( __builtin_cpu_supports("sse2") ) {
+        syndrome = syndrome_sse2;
+    }
+    if( __builtin_cpu_supports("avx2") ) {
+        gf_mul_add    = gf_mul_add_avx2;
+        diff_channels = diff_channels_avx2;
+    } else if( __builtin_cpu_supports("ssse3") ) {
+        gf_mul_add    = gf_mul_add_ssse3;
+        diff_channels = diff_channels_ssse3;
+    }
+#endif
+
+#if defined(HAVE_X86_KERNELS) && defined(__x86_64__)
+    if( __builtin_cpu_supports("sse4.2") ) {
+        crc32c = crc32c_sse42;
+    }
+#endif
+
+#if defined(HAVE_X86_KERNELS) && ENCODE_BITS_PER_CHANNEL == 2
+    if( __builtin_cpu_supports("avx512f") ) {
+        pack_bytes    = pack_bytes_avx512;
+        unpack_bytes  = unpack_bytes_avx512;
+    } else if( __builtin_cpu_supports("avx2") ) {
+        pack_bytes    = pack_bytes_avx2;
+        unpack_bytes  = unpack_bytes_avx2;
+    } else if( __builtin_cpu_supports("sse2") ) {
+        pack_bytes    = pack_bytes_sse2;
+        unpack_bytes  = unpack_bytes_sse2;
+    }
+#endif
+}
+
+/* embed n groups of bytes at BITS bits per channel. Each group is gathered
+ * into a single integer, most significant byte first, and then dealt out to
+ * its channels most significant bits first. BITS is a constant, so the
+ * compiler unrolls both loops into fixed shifts and masks */
+template <int BITS>
+void
+pack_groups ( CHANNEL *dst, const BYTE *src, size_t n ) {
+    const int bytes    = GROUP_BYTES(BITS);
+    const int channels = GROUP_CHANNELS(BITS);
+    const CHANNEL mask = BITS_MASK(BITS);
+
+    for( size_t i=0; i<n; i++, src+=bytes, dst+=channels ) {
+        uint64_t v = 0;
+        for( int j=0; j<bytes; j++ ) {
+            v = (v << BYTES_TO_BITS(1)) | src[j];
+        }
+        for( int j=0; j<channels; j++ ) {
+            dst[j] = (dst[j] & ~mask) | ((v >> ((channels-1-j)*BITS)) & mask);
+        }
+    }
+}
+
+/* retrieve n groups of bytes stored at BITS bits per channel */
+template <int BITS>
+void
+unpack_groups ( BYTE *dst, const CHANNEL *src, size_t n ) {
+    const int bytes    = GROUP_BYTES(BITS);
+    const int channels = GROUP_CHANNELS(BITS);
+    const CHANNEL mask = BITS_MASK(BITS);
+
+    for( size_t i=0; i<n; i++, src+=channels, dst+=bytes ) {
+        uint64_t v = 0;
+        for( int j=0; j<channels; j++ ) {
+            v = (v << BITS) | (src[j] & mask);
+        }
+        for( int j=0; j<bytes; j++ ) {
+            dst[j] = v >> ((bytes-1-j)*BYTES_TO_BITS(1));
+        }
+    }
+}
+
+/* at 2 bits per channel every group is a single byte, which is what the
+ * vector kernels selected by init_kernels() work on */
+template <>
+void
+pack_groups<2> ( CHANNEL *dst, const BYTE *src, size_t n ) {
+    pack_bytes( dst, src, n );
+}
+
+template <>
+void
+unpack_groups<2> ( BYTE *dst, const CHANNEL *src, size_t n ) {
+    unpack_bytes( dst, src, n );
+}
+
+template void pack_groups<1>   ( CHANNEL *dst, const BYTE *src, size_t n );
+template void pack_groups<3>   ( CHANNEL *dst, const BYTE *src, size_t n );
+template void pack_groups<4>   ( CHANNEL *dst, const BYTE *src, size_t n );
+template void pack_groups<5>   ( CHANNEL *dst, const BYTE *src, size_t n );
+template void pack_groups<6>   ( CHANNEL *dst, const BYTE *src, size_t n );
+template void pack_groups<7>   ( CHANNEL *dst, const BYTE *src, size_t n );
+template void pack_groups<8>   ( CHANNEL *dst, const BYTE *src, size_t n );
+template void unpack_groups<1> ( BYTE *dst, const CHANNEL *src, size_t n );
+template void unpack_groups<3> ( BYTE *dst, const CHANNEL *src, size_t n );
+template void unpack_groups<4> ( BYTE *dst, const CHANNEL *src, size_t n );
+template void unpack_groups<5> ( BYTE *dst, const CHANNEL *src, size_t n );
+template void unpack_groups<6> ( BYTE *dst, const CHANNEL *src, size_t n );
+template void unpack_groups<7> ( BYTE *dst, const CHANNEL *src, size_t n );
+template void unpack_groups<8> ( BYTE *dst, const CHANNEL *src, size_t n );
@@ -1,45 +1,261 @@
 #include "CImg.h"
+#include "steg.h"
+#include "rows.h"
+#include "pool.h"
+#include "fileio.h"
+#include "raster.h"
+#include "patch.h"
+#include "crypt.h"
+#include "scatter.h"
 #include <iostream>
 #include <fstream>
-#include <stdint.h>
 #include <sstream>
-#include <climits>
+#include <iomanip>
 #include <boost/filesystem.hpp>
+#include <zlib.h>
 #include <map>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+#include <cstring>
+#include <cmath>
 
-/* some helpful macros for determining things like the number of pixel channels
- * required to encode a unit of information or masks for clearing/setting bits
- * during encoding/retrieval */
-#define BYTES_TO_BITS(x)        ((x) * CHAR_BIT)
-#define NUM_CHANNEL_BITS        BYTES_TO_BITS(sizeof(CHANNEL))
-#define ENCODE_BITS_PER_CHANNEL 2
-#define CHANNEL_BIT_MASK        ((((uint64_t) 1) << ENCODE_BITS_PER_CHANNEL)-1)
-#define CHANNELS_TO_ENCODE(x)   ( BYTES_TO_BITS((x))/ENCODE_BITS_PER_CHANNEL )
+/* number of pixels the interleaved cursor copies out of the image planes at a
+ * time. A tile of this many pixels across all planes fits comfortably in L1 */
+#define TILE_PIXELS             4096
+
+/* size of the buffer used to move file data in and out of the image */
+#define IO_BUFFER_SIZE          (1 << 20)
+
+/* channels in each band of rows of two images being subtracted as they are
+ * streamed. Six bands are held at once, however large the images */
+#define SUBTRACT_BAND           (1 << 20)
+
+/* images embedded by older versions of the program begin with the (non-zero)
+ * length of the embedded filename. A zero in that position marks an extended
+ * header, in which a byte of flags follows describing how the data was
+ * embedded */
+#define HEADER_EXTENDED         0x00
+#define FLAG_PLANAR             0x01
+#define FLAG_BITS               0x02
+#define FLAG_COMPRESSED         0x04
+#define FLAG_CHECKSUM           0x08
+#define FLAG_ENCRYPTED          0x10
+#define FLAG_SCATTER            0x20
+#define FLAG_MATRIX             0x40
+#define FLAG_SHARD              0x80
+#define SUPPORTED_FLAGS         (FLAG_PLANAR | FLAG_BITS | FLAG_COMPRESSED | \
+                                 FLAG_CHECKSUM | FLAG_ENCRYPTED | \
+                                 FLAG_SCATTER | FLAG_MATRIX | FLAG_SHARD)
+
+/* flags which call for keys to be derived from the passphrase */
+#define KEYED_FLAGS             (FLAG_ENCRYPTED | FLAG_SCATTER)
+
+/* the CRC32C of the file is embedded straight after the file data when the
+ * header calls for it, as it isn't known until the whole file has been read */
+#define CHECKSUM_BYTES          sizeof(uint32_t)
+
+/* codecs with which the file may be compressed before it is embedded */
+#define CODEC_NONE              0x00
+#define CODEC_DEFLATE           0x01
+
+/* ciphers with which the file may be encrypted before it is embedded */
+#define CIPHER_CHACHA20_POLY1305 0x01
+
+/* ways in which a file may be split into shards, each embedded in an image
+ * of its own. A shard's header says which set of shards it belongs to, how
+ * many there are, where its part of the file goes and how big the whole
+ * file is, so that the file can be put back together from the shards in any
+ * order. SHARD_SPLIT cuts the file into consecutive parts.
+ * SHARD_REED_SOLOMON cuts it into parts of equal size and adds parity
+ * shards, so that the file can be rebuilt from any of the shards as long as
+ * there are as many as there were parts. The header of such a shard also
+ * says how many are needed, and the part (or parity) of shard i goes at i
+ * times the size of a part */
+#define SHARD_SPLIT             0x01
+#define SHARD_REED_SOLOMON      0x02
+#define SHARD_SET_BYTES         8
+#define SHARD_INDEX_BYTES       4
+
+/* the parity shards are the products of the parts with a Cauchy matrix over
+ * GF(2^8), whose rows and columns are numbered by the shards. There can be
+ * no more shards than there are elements of the field */
+#define MAX_CODED_SHARDS        256
+
+/* bytes of each shard worked on at a time when coding shards */
+#define CODING_CHUNK            (64*1024)
+
+/* directory in which shards are written by default */
+const char* DEFAULT_SHARD_DIR = "shards";
 
 const char* DEFAULT_OUTPUT = "out.png";
 
 /* operating modes of the program */
-enum Mode { EMBED, DECODE, SUBTRACT };
-enum ArgKey { IMAGE, EMBED_FILE, OUTPUT_FILE, SUBTRACT_FILE };
+enum Mode { EMBED, DECODE, SUBTRACT, BATCH, INFO, SHARD_EMBED, 
+    SHARD_DECODE };
+enum ArgKey { IMAGE, EMBED_FILE, OUTPUT_FILE, SUBTRACT_FILE, BATCH_FILE };
 
-typedef uint8_t  BYTE;    /* 8 bit unsigned integer */
-typedef uint64_t LONG;    /* 64 bit unsigned integer */
-typedef char     CHAR;    /* single string character */
-typedef uint8_t  CHANNEL; /* pixel unit - a single colour channel */
+/* order in which the channels of an image are visited during embedding.
+ * INTERLEAVED visits every channel of a pixel before moving on to the next
+ * pixel. PLANAR visits every pixel of a channel before moving on to the next
+ * channel, which matches the way CImg lays out image data in memory */
+enum Order { INTERLEAVED, PLANAR };
 
 typedef std::map <ArgKey,char*> ArgMap;
 
+/* raised by die() to abandon whatever the program is doing. Outside of batch
+ * mode this ends the program, but a batch carries on with its next job */
+struct StegError : public std::runtime_error {
+    StegError( const std::string &message ) : std::runtime_error(message) {}
+};
+
+/* metadata embedded in front of the file data */
+struct Header {
+    BYTE        flags;  /* zero for images using the original layout */
+    BYTE        bits;   /* bits of file data stored in each channel, or in
+                           each block of channels when matrix encoded */
+    BYTE        codec;  /* codec the file was compressed with, if any */
+    BYTE        level;  /* level the file was compressed at */
+    BYTE        cipher; /* cipher the file was encrypted with, if any */
+    BYTE        salt[SALT_BYTES]; /* salt the key was derived with */
+    BYTE        scheme; /* how the file was split into shards, if it was */
+    LONG        set;    /* identifies the shards split from one file */
+    LONG        shard;  /* index of this shard */
+    LONG        shards; /* number of shards in the set */
+    LONG        needed; /* number of shards needed to rebuild the file */
+    LONG        offset; /* where in the file this shard's part belongs */
+    LONG        total;  /* size of the whole file in bytes */
+    std::string fname;  /* name of the embedded file */
+    LONG        fsize;  /* size of the embedded file (or part) in bytes */
+};
+
+/* walks the channels of an image in embedding order and hands out pointers to
+ * them. In PLANAR order the cursor simply steps through each plane. In
+ * INTERLEAVED order, stepping straight through the image would jump a whole
+ * plane between consecutive channels, so instead the cursor copies a tile of
+ * pixels out of every plane into an interleaved buffer, works on the buffer
+ * and writes it back to the planes when it moves on to the next tile. When
+ * the image is being streamed rather than held in memory, each tile is simply
+ * the next row read from the file, and is passed on to the output image when
+ * the cursor moves on. A mapped raster is already interleaved, so the cursor
+ * points straight into it. An image being patched is read a row at a time
+ * in the same way, but rows can be visited in any order, and only those the
+ * cursor changes are written back to the file */
+struct ChannelCursor {
+    cimg_library::CImg<CHANNEL> *img; /* image being walked, if in memory */
+    RowReader *rows;     /* image being streamed, if not in memory */
+    RowWriter *out;      /* where streamed rows go once finished with */
+    const Raster *raster; /* image mapped into memory, if any */
+    const PatchFile *patch; /* image being patched where it lies, if any */
+    Order    order;
+    LONG     pixels;     /* number of pixels in a single plane */
+    int      spectrum;   /* number of channels in a pixel */
+    LONG     first;      /* pixel at which each plane is entered */
+    LONG     pix;        /* pixel the cursor currently points at */
+    int      channel;    /* channel the cursor currently points at */
+    CHANNEL *p;          /* current channel when walking in PLANAR order */
+
+    std::vector<CHANNEL> tile; /* interleaved copy of the current tile */
+    LONG     tile_pixels; /* number of pixels in a full tile */
+    LONG     tile_start; /* first pixel held in the tile */
+    LONG     tile_len;   /* number of pixels held in the tile */
+    bool     dirty;      /* tile has been modified and must be written back */
+
+    const Scatter *scatter; /* shuffle the file data follows, if any */
+    LONG     symbol;     /* channels' worth of file data scattered so far */
+};
+
 /* decode an image to a file by default */
 Mode g_mode = DECODE;
 
+/* order in which newly embedded data is laid out in the image */
+Order g_order = INTERLEAVED;
+
+/* number of threads used to embed and retrieve file data */
+int g_threads = 1;
+
+/* number of bits of file data stored in each channel of newly embedded
+ * images */
+int g_bits = ENCODE_BITS_PER_CHANNEL;
+
+/* level at which files are compressed before being embedded, or zero to
+ * embed them as they are */
+int g_level = 0;
+
+/* embed a checksum of the file so that it can be verified on retrieval */
+bool g_checksum = false;
+
+/* passphrase which files are encrypted with before they are embedded, and
+ * decrypted with on retrieval. Empty if none was given */
+std::string g_passphrase;
+
+/* scatter newly embedded files over the image in an order given by the
+ * passphrase */
+bool g_scatter = false;
+
+/* number of bits of file data matrix encoded in each block of channels of
+ * newly embedded images, or zero to store them directly */
+int g_matrix = 0;
+
+/* report what subtracting one image from another found as JSON */
+bool g_report = false;
+
+/* split the file across, or put it back together from, every image given */
+bool g_shard = false;
+
+/* number of the images given which hold parity shards when splitting a
+ * file, or zero for none */
+int g_parity = 0;
+
+/* images named after the first one. Only --info and --shard accept more than
+ * one */
+std::vector<char *> g_more_images;
+
 void
 usage() {
     std::cout<< 
-        "usage: steg [ -e FILE | -o FILE | -s IMAGE2 ] IMAGE" << std::endl
+        "usage: steg [ -e FILE | -o FILE | -p | -b N | -m N | -z N | -c "
+        "| -k KEYFILE | -r | -j N | -s IMAGE2 ] IMAGE" << std::endl
+        << "       steg -s IMAGE2 --report [ -o FILE | -j N ] IMAGE" 
+        << std::endl
+        << "       steg [ -p | -b N | -m N | -z N | -c | -k KEYFILE | -r "
+        "| -j N ] --batch MANIFEST" 
+        << std::endl
+        << "       steg --shard [ -e FILE | -o OUTPUT | --parity N | -p "
+        "| -b N | -m N | -z N | -c" << std::endl
+        << "                    | -k KEYFILE | -r | -j N ] IMAGE..." 
+        << std::endl
+        << "       steg --info IMAGE..." << std::endl
         << std::endl 
         << "-e embed FILE in IMAGE" << std::endl
         << "-o output result to FILE" << std::endl
-        << "-s subtract IMAGE2 from IMAGE" << std::endl;
+        << "-p embed FILE one colour plane at a time" << std::endl
+        << "-b embed FILE using N bits of each channel (1-8, default 2)" 
+        << std::endl
+        << "-m matrix encode N bits of FILE in every 2^N-1 channels (2-8)" 
+        << std::endl
+        << "-z compress FILE at level N (1-9) before embedding it" 
+        << std::endl
+        << "-c embed a checksum of FILE to be verified on retrieval" 
+        << std::endl
+        << "-k encrypt or decrypt FILE with the passphrase in KEYFILE" 
+        << std::endl
+        << "-r scatter FILE over IMAGE in an order given by the passphrase" 
+        << std::endl
+        << "-j use N threads, holding the whole image in memory" << std::endl
+        << "-s subtract IMAGE2 from IMAGE" << std::endl
+        << "--report describe how IMAGE2 differs from IMAGE as JSON, "
+        "writing FILE only if -o" << std::endl
+        << "         is given" << std::endl
+        << "--batch run every job listed in MANIFEST" << std::endl
+        << "--shard split FILE across every IMAGE, writing them to the "
+        "OUTPUT directory," << std::endl
+        << "        or put it back together from them" << std::endl
+        << "--parity make N of the shards parity, so that FILE survives the "
+        "loss of N images" << std::endl
+        << "--info describe the file embedded in each IMAGE as JSON" 
+        << std::endl;
     exit(-1);
 }
 
@@ -50,360 +266,4121 @@ warn( std::string message ) {
 
 void
 die( std::string message ) {
-    std::cout << "ERROR: " << message << std::endl;
-    exit(-1);
+    throw StegError( message );
+}
+
+/* copy the tile starting at the specified pixel out of the image planes and
+ * into the cursor's interleaved buffer */
+void
+load_tile ( ChannelCursor &cur, LONG start ) {
+    int spectrum = cur.spectrum;
+
+    cur.tile_start = start;
+    cur.tile_len   = std::min( cur.tile_pixels, cur.pixels - start );
+
+    if( cur.rows ) {
+        /* rows can only be read in order, skipping over any that hold
+         * nothing of interest */
+        LONG row = start / cur.tile_pixels;
+        if( row < (LONG) cur.rows->row ) {
+            die("Unable to seek backwards in a streamed image");
+        }
+        while( (LONG) cur.rows->row <= row ) {
+            if( !read_row( *cur.rows, cur.tile.data() ) ) {
+                die("Unexpected end of image data");
+            }
+            if( cur.out && (LONG) cur.rows->row <= row && 
+                    !write_row( *cur.out, cur.tile.data() ) ) {
+                die("Unable to write output image");
+            }
+        }
+
+        /* the row we stopped on is yet to be written out */
+        cur.dirty = (cur.out != NULL);
+        return;
+    }
+
+    if( cur.patch ) {
+        if( !read_patch_row( *cur.patch, start / cur.tile_pixels, 
+                    cur.tile.data() ) ) {
+            die("Unexpected end of image data");
+        }
+        return;
+    }
+
+    for( int s=0; s<spectrum; s++ ) {
+        const CHANNEL *plane = cur.img->data( 0, 0, 0, s ) + start;
+        CHANNEL *t = cur.tile.data() + s;
+        for( LONG i=0; i<cur.tile_len; i++, t+=spectrum ) {
+            *t = plane[i];
+        }
+    }
+}
+
+/* write the cursor's interleaved buffer back to the image planes, or on to
+ * the output image when streaming, provided it hasn't been already */
+void
+flush ( ChannelCursor &cur ) {
+    if( cur.order != INTERLEAVED || cur.raster || !cur.dirty ) {
+        return;
+    }
+
+    if( cur.rows ) {
+        if( cur.out && !write_row( *cur.out, cur.tile.data() ) ) {
+            die("Unable to write output image");
+        }
+        cur.dirty = false;
+        return;
+    }
+
+    if( cur.patch ) {
+        if( !write_patch_row( *cur.patch, cur.tile_start / cur.tile_pixels,
+                    cur.tile.data() ) ) {
+            die("Unable to write output image");
+        }
+        cur.dirty = false;
+        return;
+    }
+
+    int spectrum = cur.spectrum;
+    for( int s=0; s<spectrum; s++ ) {
+        CHANNEL *plane = cur.img->data( 0, 0, 0, s ) + cur.tile_start;
+        const CHANNEL *t = cur.tile.data() + s;
+        for( LONG i=0; i<cur.tile_len; i++, t+=spectrum ) {
+            plane[i] = *t;
+        }
+    }
+    cur.dirty = false;
 }
 
+/* position a cursor at the first channel of the specified pixel. When walking
+ * in PLANAR order, every plane is entered at that pixel so that the pixels
+ * before it remain free for the header */
 void
-next ( cimg_library::CImg<CHANNEL> *img, int &pix, int &channel ) {
-    /* choose next channel from those available */
-    channel = (channel + 1) % img->spectrum();
-    /* advance to next pixel if required */
-    if(!channel) {
-        pix++;
+init_cursor ( ChannelCursor &cur, cimg_library::CImg<CHANNEL> *img, Order order,
+        LONG first ) {
+    cur.img         = img;
+    cur.rows        = NULL;
+    cur.out         = NULL;
+    cur.raster      = NULL;
+    cur.patch       = NULL;
+    cur.order       = order;
+    cur.pixels      = (LONG) img->width() * img->height();
+    cur.spectrum    = img->spectrum();
+    cur.first       = first;
+    cur.pix         = first;
+    cur.channel     = 0;
+    cur.p           = img->data( 0, 0, 0, 0 ) + first;
+    cur.tile_pixels = TILE_PIXELS;
+    cur.tile_start  = 0;
+    cur.tile_len    = 0;
+    cur.dirty       = false;
+    cur.scatter     = NULL;
+    cur.symbol      = 0;
+
+    if( order == INTERLEAVED ) {
+        cur.tile.resize( cur.tile_pixels * cur.spectrum );
+    }
+}
+
+/* position a cursor at the start of an image being streamed row by row. If
+ * an output image is given, every row is written to it once the cursor has
+ * finished with it. Streamed images can only be walked in INTERLEAVED order */
+void
+init_cursor ( ChannelCursor &cur, RowReader *rows, RowWriter *out = NULL ) {
+    cur.img         = NULL;
+    cur.rows        = rows;
+    cur.out         = out;
+    cur.raster      = NULL;
+    cur.patch       = NULL;
+    cur.order       = INTERLEAVED;
+    cur.pixels      = (LONG) rows->width * rows->height;
+    cur.spectrum    = rows->spectrum;
+    cur.first       = 0;
+    cur.pix         = 0;
+    cur.channel     = 0;
+    cur.p           = NULL;
+    cur.tile_pixels = rows->width;
+    cur.tile_start  = 0;
+    cur.tile_len    = 0;
+    cur.dirty       = false;
+    cur.scatter     = NULL;
+    cur.symbol      = 0;
+    cur.tile.resize( cur.tile_pixels * cur.spectrum );
+}
+
+/* position a cursor at the start of an image mapped into memory */
+void
+init_cursor ( ChannelCursor &cur, const Raster *raster ) {
+    cur.img         = NULL;
+    cur.rows        = NULL;
+    cur.out         = NULL;
+    cur.raster      = raster;
+    cur.patch       = NULL;
+    cur.order       = INTERLEAVED;
+    cur.pixels      = (LONG) raster->width * raster->height;
+    cur.spectrum    = raster->spectrum;
+    cur.first       = 0;
+    cur.pix         = 0;
+    cur.channel     = 0;
+    cur.p           = NULL;
+    cur.tile_pixels = cur.pixels;
+    cur.tile_start  = 0;
+    cur.tile_len    = 0;
+    cur.dirty       = false;
+    cur.scatter     = NULL;
+    cur.symbol      = 0;
+}
+
+/* position a cursor at the start of an image being patched in place */
+void
+init_cursor ( ChannelCursor &cur, const PatchFile *patch ) {
+    cur.img         = NULL;
+    cur.rows        = NULL;
+    cur.out         = NULL;
+    cur.raster      = NULL;
+    cur.patch       = patch;
+    cur.order       = INTERLEAVED;
+    cur.pixels      = (LONG) patch->width * patch->height;
+    cur.spectrum    = patch->spectrum;
+    cur.first       = 0;
+    cur.pix         = 0;
+    cur.channel     = 0;
+    cur.p           = NULL;
+    cur.tile_pixels = patch->width;
+    cur.tile_start  = 0;
+    cur.tile_len    = 0;
+    cur.dirty       = false;
+    cur.scatter     = NULL;
+    cur.symbol      = 0;
+    cur.tile.resize( cur.tile_pixels * cur.spectrum );
+}
+
+/* position a cursor at the start of the same image as another, for a worker
+ * thread to walk part of it. Streamed images can't be shared this way */
+void
+init_cursor ( ChannelCursor &cur, const ChannelCursor &from ) {
+    if( from.raster ) {
+        init_cursor( cur, from.raster );
+    } else if( from.patch ) {
+        init_cursor( cur, from.patch );
+    } else {
+        init_cursor( cur, from.img, from.order, from.first );
+    }
+}
+
+/* write out the row the cursor is on and copy every row after it from the
+ * streamed image to the output image unchanged */
+void
+finish_rows ( ChannelCursor &cur ) {
+    flush( cur );
+
+    while( cur.rows->row < cur.rows->height ) {
+        if( !read_row( *cur.rows, cur.tile.data() ) ) {
+            die("Unexpected end of image data");
+        }
+        if( !write_row( *cur.out, cur.tile.data() ) ) {
+            die("Unable to write output image");
+        }
+    }
+}
+
+/* return a pointer to the channel the cursor currently points at */
+CHANNEL *
+channel_at ( ChannelCursor &cur ) {
+    /* a damaged or missing header can send us past the end of the image */
+    if( cur.pix >= cur.pixels ) {
+        die("Unexpected end of image data");
+    }
+
+    if( cur.order == PLANAR ) {
+        return cur.p;
+    }
+
+    if( cur.raster ) {
+        return cur.raster->data + cur.pix * cur.spectrum + cur.channel;
+    }
+
+    /* bring the tile containing the current pixel into the buffer if it is
+     * not already there */
+    if( cur.pix < cur.tile_start || cur.pix >= cur.tile_start + cur.tile_len ) {
+        flush( cur );
+        load_tile( cur, cur.pix - cur.pix % cur.tile_pixels );
+    }
+
+    return cur.tile.data() + 
+        (cur.pix - cur.tile_start) * cur.spectrum + cur.channel;
+}
+
+/* move the cursor on to the next channel in embedding order */
+void
+next ( ChannelCursor &cur ) {
+    if( cur.order == PLANAR ) {
+        /* advance along the current plane, dropping to the start of the next
+         * plane once we run off the end of this one */
+        cur.p++;
+        if( ++cur.pix == cur.pixels && ++cur.channel < cur.spectrum ) {
+            cur.pix = cur.first;
+            cur.p   = cur.img->data( 0, 0, 0, cur.channel ) + cur.first;
+        }
+    } else {
+        /* choose next channel from those available */
+        cur.channel = (cur.channel + 1) % cur.spectrum;
+        /* advance to next pixel if required */
+        if(!cur.channel) {
+            cur.pix++;
+        }
+    }
+}
+
+/* return a pointer to the channel the cursor currently points at, along with
+ * the number of channels which follow it contiguously in embedding order -
+ * the rest of the tile in INTERLEAVED order or the rest of the plane in
+ * PLANAR order */
+CHANNEL *
+channel_run ( ChannelCursor &cur, LONG &len ) {
+    CHANNEL *p = channel_at( cur );
+
+    if( cur.order == PLANAR ) {
+        len = cur.pixels - cur.pix;
+    } else if( cur.raster ) {
+        len = (cur.pixels - cur.pix) * cur.spectrum - cur.channel;
+    } else {
+        len = (cur.tile_start + cur.tile_len - cur.pix) * cur.spectrum - 
+            cur.channel;
+    }
+    return p;
+}
+
+/* move the cursor forward by a number of channels which must not exceed the
+ * length of the run returned by channel_run() */
+void
+skip ( ChannelCursor &cur, LONG count ) {
+    if( cur.order == PLANAR ) {
+        cur.p += count;
+        cur.pix += count;
+        if( cur.pix == cur.pixels && ++cur.channel < cur.spectrum ) {
+            cur.pix = cur.first;
+            cur.p   = cur.img->data( 0, 0, 0, cur.channel ) + cur.first;
+        }
+    } else {
+        LONG offset = cur.channel + count;
+        cur.pix += offset / cur.spectrum;
+        cur.channel = offset % cur.spectrum;
+    }
+}
+
+/* index of the channel the cursor points at, counting in embedding order.
+ * In INTERLEAVED order this counts from the start of the image, while in
+ * PLANAR order it counts from the pixel at which each plane is entered */
+LONG
+position ( const ChannelCursor &cur ) {
+    if( cur.order == PLANAR ) {
+        return cur.channel * (cur.pixels - cur.first) + cur.pix - cur.first;
+    }
+    return cur.pix * cur.spectrum + cur.channel;
+}
+
+/* move the cursor to the channel with the given index, as returned by
+ * position(). This can move in either direction, so only works on images
+ * held in memory */
+void
+seek ( ChannelCursor &cur, LONG index ) {
+    if( cur.order == PLANAR ) {
+        LONG plane_len = cur.pixels - cur.first;
+        cur.channel = index / plane_len;
+        cur.pix     = cur.first + index % plane_len;
+        cur.p       = (cur.channel < cur.spectrum)? 
+            cur.img->data( 0, 0, 0, cur.channel ) + cur.pix : NULL;
+    } else {
+        cur.pix     = index / cur.spectrum;
+        cur.channel = index % cur.spectrum;
     }
 }
 
-/* embed a unit of information starting at the specified location in the
- * image. This function will update the pix and channel ints to point to the
- * location just after the embedded information once the operation is 
+/* buffer used to move file data in and out of the image. It is allocated
+ * once and shared by every job a thread runs. When working on one image in
+ * parallel each thread gets a full sized share of it */
+std::vector<BYTE> &
+io_buffer () {
+    static thread_local std::vector<BYTE> buffer;
+    buffer.resize( (size_t) IO_BUFFER_SIZE * g_threads );
+    return buffer;
+}
+
+/* embed a unit of information starting at the cursor's location in the
+ * image, at BITS bits per channel. A unit whose bits don't fill its last
+ * channel is padded out with zero bits. This function will move the cursor to
+ * the location just after the embedded information once the operation is
  * complete */
+template <int BITS = ENCODE_BITS_PER_CHANNEL>
 void
-embed ( cimg_library::CImg<CHANNEL> *img, LONG data, size_t bytes,
-        int &pix, int &channel ) {
+embed ( ChannelCursor &cur, LONG data, size_t bytes ) {
+    const LONG channels = CHANNELS_AT_BITS(bytes, BITS);
+
+    data <<= channels*BITS - BYTES_TO_BITS(bytes);
 
     /* compute how many channels we'll need to store the data and begin to 
      * iterate over them, storing as necessary */
-    for( unsigned int i=0; i<CHANNELS_TO_ENCODE(bytes); i++) {
+    for( LONG i=0; i<channels; i++) {
         /* retrieve the next channel to be used for encoding from the image */
-        CHANNEL *p = img->data( pix%img->width(), pix/img->width(), 0, 
-                channel );
+        CHANNEL *p = channel_at( cur );
         
         /* clear the target bits of the image to remove any information
          * that is already stored there */        
-        *p &= ~CHANNEL_BIT_MASK;
+        *p &= ~BITS_MASK(BITS);
         
         /* now embed the required number of bits in the cleared pixel channel
          * bits */
-        *p |= (data >> ((CHANNELS_TO_ENCODE(bytes)-1-i)*
-                    ENCODE_BITS_PER_CHANNEL)) & CHANNEL_BIT_MASK;
+        *p |= (data >> ((channels-1-i)*BITS)) & BITS_MASK(BITS);
+        cur.dirty = true;
         
-        /* update pix and channel to be the indexes of the next pixel/channel
-         * combination of interest */
-        next( img, pix, channel );
+        /* move the cursor on to the next channel of interest */
+        next( cur );
     }    
 }
 
-/* retrieve a unit of information from the specified location in the encoded
- * image. The function will update the values of pix and channel to point to
- * the location just after the retrieved data's location */
+/* retrieve a unit of information from the cursor's location in the encoded
+ * image, stored at BITS bits per channel. The function will move the cursor
+ * to the location just after the retrieved data's location */
+template <int BITS = ENCODE_BITS_PER_CHANNEL>
 LONG
-retrieve ( cimg_library::CImg<CHANNEL> *img, size_t bytes, int &pix, 
-        int &channel ) {
+retrieve ( ChannelCursor &cur, size_t bytes ) {
+    const LONG channels = CHANNELS_AT_BITS(bytes, BITS);
 
     LONG c = 0;
 
-    for( LONG i=0; i<CHANNELS_TO_ENCODE(bytes); i++ ) {
+    for( LONG i=0; i<channels; i++ ) {
         /* retrieve a channel containing information we need to extract */
-        CHANNEL *p = img->data( pix%img->width(), pix/img->width(), 0, 
-                channel );
+        CHANNEL *p = channel_at( cur );
         
         /* extrct the encoded bits from the channel and merge with a running
          * tally of bits */
-        c = (c << ENCODE_BITS_PER_CHANNEL) | (*p & CHANNEL_BIT_MASK);
+        c = (c << BITS) | (*p & BITS_MASK(BITS));
         
-        /* update pix and channel to be the indexes of the next pixel/channel
-         * combination of interest */
-        next( img, pix, channel );        
+        /* move the cursor on to the next channel of interest */
+        next( cur );        
     } 
 
-    /* return the retrieved data */
-    return c;  
+    /* return the retrieved data, less any padding */
+    return c >> (channels*BITS - BYTES_TO_BITS(bytes));  
+}
+
+/* gather up to a group of bytes into a single unit, first byte uppermost */
+LONG
+load_group ( const BYTE *data, size_t bytes ) {
+    LONG v = 0;
+    for( size_t i=0; i<bytes; i++ ) {
+        v = (v << BYTES_TO_BITS(1)) | data[i];
+    }
+    return v;
 }
 
+/* the counterpart of load_group() */
 void
-subtract_images ( cimg_library::CImg<CHANNEL> &img,  
-        cimg_library::CImg<CHANNEL> &sub,
-        cimg_library::CImg<CHANNEL> &result ) {
-   
-    unsigned int max = img.max(); 
-    for(int x=0; x<img.width(); x++) {
-        for(int y=0; y<img.height(); y++) {
-            for( int s=0; s<img.spectrum(); s++ ) {
-                CHANNEL *p1 = img.data( x, y, 0, s );
-                CHANNEL *p2 = sub.data( x, y, 0, s );
-                CHANNEL *p3 = result.data( x, y, 0, s );
-                
-                /* Normalize the difference based on the largest pixel value
-                 * in the image */
-                *p3 = (((double)abs(*p1 - *p2))/CHANNEL_BIT_MASK)*max;
+store_group ( BYTE *data, LONG v, size_t bytes ) {
+    for( size_t i=bytes; i>0; i--, v >>= BYTES_TO_BITS(1) ) {
+        data[i-1] = v;
+    }
+}
+
+/* embed a buffer of bytes starting at the cursor's location in the image, at
+ * BITS bits per channel. The buffer is handed to pack_groups() one contiguous
+ * run of channels at a time; only a group which straddles the end of a run,
+ * or a part group at the end of the buffer, is embedded channel by channel */
+template <int BITS>
+void
+embed_bytes ( ChannelCursor &cur, const BYTE *data, size_t n ) {
+    const LONG group_bytes    = GROUP_BYTES(BITS);
+    const LONG group_channels = GROUP_CHANNELS(BITS);
+
+    while( n ) {
+        LONG len;
+        CHANNEL *run = channel_run( cur, len );
+        size_t whole = std::min( n / group_bytes, len / group_channels );
+
+        if( whole ) {
+            pack_groups<BITS>( run, data, whole );
+            cur.dirty = true;
+            skip( cur, whole * group_channels );
+            whole *= group_bytes;
+        } else {
+            whole = std::min( (LONG) n, group_bytes );
+            embed<BITS>( cur, load_group( data, whole ), whole );
+        }
+
+        data += whole;
+        n    -= whole;
+    }
+}
+
+/* retrieve a buffer of bytes starting at the cursor's location in the image.
+ * This is the counterpart of embed_bytes() */
+template <int BITS>
+void
+retrieve_bytes ( ChannelCursor &cur, BYTE *data, size_t n ) {
+    const LONG group_bytes    = GROUP_BYTES(BITS);
+    const LONG group_channels = GROUP_CHANNELS(BITS);
+
+    while( n ) {
+        LONG len;
+        const CHANNEL *run = channel_run( cur, len );
+        size_t whole = std::min( n / group_bytes, len / group_channels );
+
+        if( whole ) {
+            unpack_groups<BITS>( data, run, whole );
+            skip( cur, whole * group_channels );
+            whole *= group_bytes;
+        } else {
+            whole = std::min( (LONG) n, group_bytes );
+            store_group( data, retrieve<BITS>( cur, whole ), whole );
+        }
+
+        data += whole;
+        n    -= whole;
+    }
+}
+
+/* split n groups of file data, starting at the cursor's location, into one
+ * part for each thread. Every group's location follows directly from its
+ * offset, so each part can be worked on independently by a cursor of its
+ * own. In INTERLEAVED order those cursors each copy whole tiles in and out
+ * of the image (unless it is a mapped raster), so parts are made to begin on
+ * a tile boundary to stop two threads working on the same tile. A group
+ * which straddles a tile boundary then belongs to neither part and is left
+ * in straddle for the caller to deal with once the threads are done */
+void
+split_groups ( const ChannelCursor &cur, size_t n, LONG group_channels,
+        int parts, std::vector<size_t> &first, std::vector<size_t> &last,
+        std::vector<size_t> &straddle ) {
+    const LONG tile = (cur.order == INTERLEAVED && !cur.raster)? 
+        cur.tile_pixels * cur.spectrum : 1;
+    LONG base = position( cur );
+
+    first.clear();
+    last.clear();
+    straddle.clear();
+
+    /* channel at which each part begins, rounded down to a tile */
+    std::vector<LONG> bound( parts + 1 );
+    for( int i=0; i<=parts; i++ ) {
+        LONG c = base + group_channels * (n * i / parts);
+        if( i > 0 && i < parts ) {
+            c = std::max( base, c - c % tile );
+        }
+        bound[i] = std::max( c, (i > 0)? bound[i-1] : base );
+    }
+
+    for( int i=0; i<parts; i++ ) {
+        first.push_back( (bound[i] - base + group_channels - 1) / 
+                group_channels );
+        last.push_back( (bound[i+1] - base) / group_channels );
+        if( i > 0 && (bound[i] - base) % group_channels ) {
+            straddle.push_back( (bound[i] - base) / group_channels );
+        }
+    }
+}
+
+/* embed a buffer of bytes starting at the cursor's location in the image,
+ * spread across the worker threads. The result is identical to that of
+ * embed_bytes() */
+template <int BITS>
+void
+embed_bytes_parallel ( ChannelCursor &cur, const BYTE *data, size_t n ) {
+    const LONG group_bytes    = GROUP_BYTES(BITS);
+    const LONG group_channels = GROUP_CHANNELS(BITS);
+    std::vector<size_t> first, last, straddle;
+    size_t groups = n / group_bytes;
+    LONG base = position( cur );
+
+    /* the threads load tiles from the image, so anything still held in the
+     * cursor needs to be written back first, and is out of date afterwards */
+    flush( cur );
+    cur.tile_len = 0;
+    split_groups( cur, groups, group_channels, worker_count(), first, last, 
+            straddle );
+
+    run_parallel( first.size(), [&]( int i ) {
+        if( first[i] >= last[i] ) {
+            return;
+        }
+        ChannelCursor part;
+        init_cursor( part, cur );
+        seek( part, base + first[i] * group_channels );
+        embed_bytes<BITS>( part, data + first[i] * group_bytes, 
+                (last[i] - first[i]) * group_bytes );
+        flush( part );
+    });
+
+    for( size_t i=0; i<straddle.size(); i++ ) {
+        seek( cur, base + straddle[i] * group_channels );
+        embed<BITS>( cur, load_group( data + straddle[i] * group_bytes, 
+                    group_bytes ), group_bytes );
+    }
+
+    /* any part group left at the end of the buffer follows on directly */
+    seek( cur, base + groups * group_channels );
+    embed_bytes<BITS>( cur, data + groups * group_bytes, 
+            n - groups * group_bytes );
+}
+
+/* retrieve a buffer of bytes starting at the cursor's location in the image,
+ * with each worker thread extracting its own slice of the buffer. This is
+ * the counterpart of embed_bytes_parallel() */
+template <int BITS>
+void
+retrieve_bytes_parallel ( ChannelCursor &cur, BYTE *data, size_t n ) {
+    const LONG group_bytes    = GROUP_BYTES(BITS);
+    const LONG group_channels = GROUP_CHANNELS(BITS);
+    std::vector<size_t> first, last, straddle;
+    size_t groups = n / group_bytes;
+    LONG base = position( cur );
+
+    split_groups( cur, groups, group_channels, worker_count(), first, last, 
+            straddle );
+
+    run_parallel( first.size(), [&]( int i ) {
+        if( first[i] >= last[i] ) {
+            return;
+        }
+        ChannelCursor part;
+        init_cursor( part, cur );
+        seek( part, base + first[i] * group_channels );
+        retrieve_bytes<BITS>( part, data + first[i] * group_bytes, 
+                (last[i] - first[i]) * group_bytes );
+    });
+
+    for( size_t i=0; i<straddle.size(); i++ ) {
+        seek( cur, base + straddle[i] * group_channels );
+        store_group( data + straddle[i] * group_bytes, 
+                retrieve<BITS>( cur, group_bytes ), group_bytes );
+    }
+
+    seek( cur, base + groups * group_channels );
+    retrieve_bytes<BITS>( cur, data + groups * group_bytes, 
+            n - groups * group_bytes );
+}
+
+/* buffer holding file data a channel's worth at a time, on its way to or
+ * from scattered channels */
+std::vector<CHANNEL> &
+symbol_buffer () {
+    static thread_local std::vector<CHANNEL> buffer;
+    return buffer;
+}
+
+/* visit the channels which hold the next count channels' worth of file data
+ * in a scattered image, handing visit() a pointer to each along with its
+ * place in the data. The channels are visited a region at a time, with the
+ * regions split between the worker threads */
+template <typename Visit>
+void
+visit_scattered ( ChannelCursor &cur, LONG count, const Visit &visit ) {
+    const Scatter &scatter = *cur.scatter;
+    const LONG regions = scatter.regions;
+    const LONG start = cur.symbol;
+    std::vector<CHANNEL *> planes( cur.spectrum );
+    LONG stride;
+
+    if( cur.raster ) {
+        for( int s=0; s<cur.spectrum; s++ ) {
+            planes[s] = cur.raster->data + s;
+        }
+        stride = cur.spectrum;
+    } else if( cur.img ) {
+        /* the planes are visited directly, so the cursor's tile has to be
+         * written back first, and is out of date afterwards */
+        flush( cur );
+        cur.tile_len = 0;
+        for( int s=0; s<cur.spectrum; s++ ) {
+            planes[s] = cur.img->data( 0, 0, 0, s );
+        }
+        stride = 1;
+    } else {
+        die("Unable to scatter data over a streamed image");
+    }
+
+    /* successive channels' worth of data go to successive regions, so the
+     * first few determine which regions are visited */
+    LONG visits = std::min( count, regions );
+    int parts = (g_threads > 1)? worker_count() : 1;
+
+    auto task = [&]( int part ) {
+        LONG end = visits * (part + 1) / parts;
+        for( LONG v = visits * part / parts; v<end; v++ ) {
+            LONG k = start + v;
+            LONG region = k % regions;
+            LONG rotation = region_rotation( scatter, region );
+            LONG base = scatter.first + region * scatter.region;
+
+            for( LONG j = k / regions; k < start + count; k += regions, j++ ) {
+                LONG slot = j + rotation;
+                if( slot >= scatter.channels ) {
+                    slot -= scatter.channels;
+                }
+                visit( planes[scatter.channel[slot]] + 
+                        (base + scatter.pixel[slot]) * stride, k - start );
+            }
+        }
+    };
+
+    if( parts > 1 ) {
+        run_parallel( parts, task );
+    } else {
+        task( 0 );
+    }
+
+    cur.symbol += count;
+}
+
+/* spread n bytes of file data out into symbols of BITS bits, one to a byte
+ * of the symbol buffer, padding the last with zero bits. Returns the number
+ * of symbols */
+template <int BITS>
+LONG
+to_symbols ( const BYTE *data, size_t n, std::vector<CHANNEL> &symbols ) {
+    const size_t group_bytes = GROUP_BYTES(BITS);
+    const LONG group_channels = GROUP_CHANNELS(BITS);
+    size_t groups = n / group_bytes;
+    size_t tail = n % group_bytes;
+    LONG count = CHANNELS_AT_BITS(n, BITS);
+
+    symbols.assign( count, 0 );
+    pack_groups<BITS>( symbols.data(), data, groups );
+    if( tail ) {
+        BYTE last[MAX_BITS_PER_CHANNEL] = { 0 };
+        CHANNEL packed[BYTES_TO_BITS(1)] = { 0 };
+        memcpy( last, data + groups * group_bytes, tail );
+        pack_groups<BITS>( packed, last, 1 );
+        memcpy( symbols.data() + groups * group_channels, packed,
+                count - groups * group_channels );
+    }
+    return count;
+}
+
+/* gather n bytes of file data back up from symbols of BITS bits. This is the
+ * counterpart of to_symbols() */
+template <int BITS>
+void
+from_symbols ( const std::vector<CHANNEL> &symbols, BYTE *data, size_t n ) {
+    const size_t group_bytes = GROUP_BYTES(BITS);
+    const LONG group_channels = GROUP_CHANNELS(BITS);
+    size_t groups = n / group_bytes;
+    size_t tail = n % group_bytes;
+    LONG count = CHANNELS_AT_BITS(n, BITS);
+
+    unpack_groups<BITS>( data, symbols.data(), groups );
+    if( tail ) {
+        CHANNEL packed[BYTES_TO_BITS(1)] = { 0 };
+        BYTE last[MAX_BITS_PER_CHANNEL];
+        memcpy( packed, symbols.data() + groups * group_channels,
+                count - groups * group_channels );
+        unpack_groups<BITS>( last, packed, 1 );
+        memcpy( data + groups * group_bytes, last, tail );
+    }
+}
+
+/* embed a block of file data in a scattered image at BITS bits per channel.
+ * The data is first spread out a channel's worth to a byte by the usual
+ * kernels, and then put in place a region at a time */
+template <int BITS>
+void
+embed_scattered ( ChannelCursor &cur, const BYTE *data, size_t n ) {
+    const CHANNEL mask = BITS_MASK(BITS);
+    std::vector<CHANNEL> &symbols = symbol_buffer();
+    LONG count = to_symbols<BITS>( data, n, symbols );
+
+    visit_scattered( cur, count, [&]( CHANNEL *p, LONG i ) {
+        *p = (*p & ~mask) | symbols[i];
+    });
+}
+
+/* retrieve a block of file data from a scattered image. This is the
+ * counterpart of embed_scattered() */
+template <int BITS>
+void
+retrieve_scattered ( ChannelCursor &cur, BYTE *data, size_t n ) {
+    const CHANNEL mask = BITS_MASK(BITS);
+    std::vector<CHANNEL> &symbols = symbol_buffer();
+    LONG count = CHANNELS_AT_BITS(n, BITS);
+
+    symbols.resize( count );
+    visit_scattered( cur, count, [&]( CHANNEL *p, LONG i ) {
+        symbols[i] = *p & mask;
+    });
+    from_symbols<BITS>( symbols, data, n );
+}
+
+/* embed a symbol of k bits in the block of channels at the cursor by matrix
+ * encoding, when the block straddles the end of a run of channels. Its
+ * channels are read one at a time, and the cursor then goes back for the
+ * one which has to change */
+void
+embed_codeword ( ChannelCursor &cur, CHANNEL symbol, LONG channels ) {
+    LONG start = position( cur );
+    uint32_t s = symbol;
+
+    for( LONG i=1; i<=channels; i++ ) {
+        if( *channel_at( cur ) & 1 ) {
+            s ^= i;
+        }
+        next( cur );
+    }
+
+    if( s ) {
+        seek( cur, start + s - 1 );
+        *channel_at( cur ) ^= 1;
+        cur.dirty = true;
+        seek( cur, start + channels );
+    }
+}
+
+/* retrieve a symbol matrix encoded in a block which straddles the end of a
+ * run of channels */
+CHANNEL
+retrieve_codeword ( ChannelCursor &cur, LONG channels ) {
+    uint32_t s = 0;
+
+    for( LONG i=1; i<=channels; i++ ) {
+        if( *channel_at( cur ) & 1 ) {
+            s ^= i;
+        }
+        next( cur );
+    }
+    return s;
+}
+
+/* embed count symbols of k bits by matrix encoding, one to each block of
+ * MATRIX_CHANNELS(k) channels from the cursor on. Flipping the least
+ * significant bit of the channel at the position given by the exclusive or
+ * of a block's syndrome and its symbol makes the syndrome the symbol, so
+ * at most one channel in each block changes. Blocks are worked on where
+ * they lie within each contiguous run of channels */
+void
+embed_codewords ( ChannelCursor &cur, const CHANNEL *symbols, size_t count,
+        int k ) {
+    const LONG channels = MATRIX_CHANNELS(k);
+
+    while( count ) {
+        LONG len;
+        CHANNEL *run = channel_run( cur, len );
+        size_t whole = std::min( count, (size_t) (len / channels) );
+
+        if( whole ) {
+            for( size_t i=0; i<whole; i++, run+=channels ) {
+                uint32_t s = syndrome( run, channels ) ^ symbols[i];
+                if( s ) {
+                    run[s-1] ^= 1;
+                    cur.dirty = true;
+                }
+            }
+            skip( cur, whole * channels );
+        } else {
+            whole = 1;
+            embed_codeword( cur, symbols[0], channels );
+        }
+
+        symbols += whole;
+        count   -= whole;
+    }
+}
+
+/* retrieve count symbols of k bits matrix encoded from the cursor on. This
+ * is the counterpart of embed_codewords() */
+void
+retrieve_codewords ( ChannelCursor &cur, CHANNEL *symbols, size_t count,
+        int k ) {
+    const LONG channels = MATRIX_CHANNELS(k);
+
+    while( count ) {
+        LONG len;
+        const CHANNEL *run = channel_run( cur, len );
+        size_t whole = std::min( count, (size_t) (len / channels) );
+
+        if( whole ) {
+            for( size_t i=0; i<whole; i++, run+=channels ) {
+                symbols[i] = syndrome( run, channels );
             }
+            skip( cur, whole * channels );
+        } else {
+            whole = 1;
+            symbols[0] = retrieve_codeword( cur, channels );
+        }
+
+        symbols += whole;
+        count   -= whole;
+    }
+}
+
+/* embed matrix encoded symbols spread across the worker threads, splitting
+ * them up in the same way as embed_bytes_parallel() with every block of
+ * channels taking the place of a group. The result is identical to that of
+ * embed_codewords() */
+void
+embed_codewords_parallel ( ChannelCursor &cur, const CHANNEL *symbols, 
+        size_t count, int k ) {
+    const LONG channels = MATRIX_CHANNELS(k);
+    std::vector<size_t> first, last, straddle;
+    LONG base = position( cur );
+
+    flush( cur );
+    cur.tile_len = 0;
+    split_groups( cur, count, channels, worker_count(), first, last, 
+            straddle );
+
+    run_parallel( first.size(), [&]( int i ) {
+        if( first[i] >= last[i] ) {
+            return;
+        }
+        ChannelCursor part;
+        init_cursor( part, cur );
+        seek( part, base + first[i] * channels );
+        embed_codewords( part, symbols + first[i], last[i] - first[i], k );
+        flush( part );
+    });
+
+    for( size_t i=0; i<straddle.size(); i++ ) {
+        seek( cur, base + straddle[i] * channels );
+        embed_codeword( cur, symbols[straddle[i]], channels );
+    }
+    seek( cur, base + count * channels );
+}
+
+/* retrieve matrix encoded symbols spread across the worker threads. This is
+ * the counterpart of embed_codewords_parallel() */
+void
+retrieve_codewords_parallel ( ChannelCursor &cur, CHANNEL *symbols, 
+        size_t count, int k ) {
+    const LONG channels = MATRIX_CHANNELS(k);
+    std::vector<size_t> first, last, straddle;
+    LONG base = position( cur );
+
+    split_groups( cur, count, channels, worker_count(), first, last, 
+            straddle );
+
+    run_parallel( first.size(), [&]( int i ) {
+        if( first[i] >= last[i] ) {
+            return;
+        }
+        ChannelCursor part;
+        init_cursor( part, cur );
+        seek( part, base + first[i] * channels );
+        retrieve_codewords( part, symbols + first[i], last[i] - first[i], 
+                k );
+    });
+
+    for( size_t i=0; i<straddle.size(); i++ ) {
+        seek( cur, base + straddle[i] * channels );
+        symbols[straddle[i]] = retrieve_codeword( cur, channels );
+    }
+    seek( cur, base + count * channels );
+}
+
+/* buffer holding a copy of the channels which matrix encoded file data is
+ * scattered over, gathered so that each block lies in one piece */
+std::vector<CHANNEL> &
+block_buffer () {
+    static thread_local std::vector<CHANNEL> buffer;
+    return buffer;
+}
+
+/* embed matrix encoded symbols in a scattered image. The channels of each
+ * block are gathered into the block buffer, encoded there, and only those
+ * which have changed are put back */
+void
+embed_codewords_scattered ( ChannelCursor &cur, const CHANNEL *symbols,
+        size_t count, int k ) {
+    const LONG channels = MATRIX_CHANNELS(k);
+    std::vector<CHANNEL> &blocks = block_buffer();
+
+    blocks.resize( count * channels );
+    visit_scattered( cur, count * channels, [&]( CHANNEL *p, LONG i ) {
+        blocks[i] = *p;
+    });
+
+    for( size_t i=0; i<count; i++ ) {
+        CHANNEL *block = blocks.data() + i * channels;
+        uint32_t s = syndrome( block, channels ) ^ symbols[i];
+        if( s ) {
+            block[s-1] ^= 1;
+        }
+    }
+
+    /* the same channels are visited again to put the blocks back */
+    cur.symbol -= count * channels;
+    visit_scattered( cur, count * channels, [&]( CHANNEL *p, LONG i ) {
+        if( *p != blocks[i] ) {
+            *p = blocks[i];
+        }
+    });
+}
+
+/* retrieve matrix encoded symbols from a scattered image */
+void
+retrieve_codewords_scattered ( ChannelCursor &cur, CHANNEL *symbols,
+        size_t count, int k ) {
+    const LONG channels = MATRIX_CHANNELS(k);
+    std::vector<CHANNEL> &blocks = block_buffer();
+
+    blocks.resize( count * channels );
+    visit_scattered( cur, count * channels, [&]( CHANNEL *p, LONG i ) {
+        blocks[i] = *p;
+    });
+
+    for( size_t i=0; i<count; i++ ) {
+        symbols[i] = syndrome( blocks.data() + i * channels, channels );
+    }
+}
+
+/* embed a block of file data by matrix encoding, K bits to each block of
+ * MATRIX_CHANNELS(K) channels */
+template <int K>
+void
+embed_matrix ( ChannelCursor &cur, const BYTE *data, size_t n ) {
+    std::vector<CHANNEL> &symbols = symbol_buffer();
+    LONG count = to_symbols<K>( data, n, symbols );
+
+    if( cur.scatter ) {
+        embed_codewords_scattered( cur, symbols.data(), count, K );
+    } else if( g_threads > 1 && !cur.rows ) {
+        embed_codewords_parallel( cur, symbols.data(), count, K );
+    } else {
+        embed_codewords( cur, symbols.data(), count, K );
+    }
+}
+
+/* retrieve a block of matrix encoded file data */
+template <int K>
+void
+retrieve_matrix ( ChannelCursor &cur, BYTE *data, size_t n ) {
+    std::vector<CHANNEL> &symbols = symbol_buffer();
+    LONG count = CHANNELS_AT_BITS(n, K);
+
+    symbols.resize( count );
+    if( cur.scatter ) {
+        retrieve_codewords_scattered( cur, symbols.data(), count, K );
+    } else if( g_threads > 1 && !cur.rows ) {
+        retrieve_codewords_parallel( cur, symbols.data(), count, K );
+    } else {
+        retrieve_codewords( cur, symbols.data(), count, K );
+    }
+    from_symbols<K>( symbols, data, n );
+}
+
+/* embed a block of file data at BITS bits per channel, spreading the work
+ * across the worker threads unless the image is being streamed */
+template <int BITS>
+void
+embed_block ( ChannelCursor &cur, const BYTE *data, size_t n ) {
+    if( cur.scatter ) {
+        embed_scattered<BITS>( cur, data, n );
+    } else if( g_threads > 1 && !cur.rows ) {
+        embed_bytes_parallel<BITS>( cur, data, n );
+    } else {
+        embed_bytes<BITS>( cur, data, n );
+    }
+}
+
+/* retrieve a block of file data stored at BITS bits per channel */
+template <int BITS>
+void
+retrieve_block ( ChannelCursor &cur, BYTE *data, size_t n ) {
+    if( cur.scatter ) {
+        retrieve_scattered<BITS>( cur, data, n );
+    } else if( g_threads > 1 && !cur.rows ) {
+        retrieve_bytes_parallel<BITS>( cur, data, n );
+    } else {
+        retrieve_bytes<BITS>( cur, data, n );
+    }
+}
+
+/* embed a block of file data at the number of bits per channel recorded in
+ * the header. Blocks other than the last must hold whole groups of bytes */
+void
+embed_data ( ChannelCursor &cur, const Header &header, const BYTE *data,
+        size_t n ) {
+    if( header.flags & FLAG_MATRIX ) {
+        switch( header.bits ) {
+            case 2: embed_matrix<2>( cur, data, n ); break;
+            case 3: embed_matrix<3>( cur, data, n ); break;
+            case 4: embed_matrix<4>( cur, data, n ); break;
+            case 5: embed_matrix<5>( cur, data, n ); break;
+            case 6: embed_matrix<6>( cur, data, n ); break;
+            case 7: embed_matrix<7>( cur, data, n ); break;
+            case 8: embed_matrix<8>( cur, data, n ); break;
+            default: die("Unsupported matrix encoding");
+        }
+        return;
+    }
+
+    switch( header.bits ) {
+        case 1: embed_block<1>( cur, data, n ); break;
+        case 2: embed_block<2>( cur, data, n ); break;
+        case 3: embed_block<3>( cur, data, n ); break;
+        case 4: embed_block<4>( cur, data, n ); break;
+        case 5: embed_block<5>( cur, data, n ); break;
+        case 6: embed_block<6>( cur, data, n ); break;
+        case 7: embed_block<7>( cur, data, n ); break;
+        case 8: embed_block<8>( cur, data, n ); break;
+        default: die("Unsupported number of bits per channel");
+    }
+}
+
+/* retrieve a block of file data. This is the counterpart of embed_data() */
+void
+retrieve_data ( ChannelCursor &cur, const Header &header, BYTE *data,
+        size_t n ) {
+    if( header.flags & FLAG_MATRIX ) {
+        switch( header.bits ) {
+            case 2: retrieve_matrix<2>( cur, data, n ); break;
+            case 3: retrieve_matrix<3>( cur, data, n ); break;
+            case 4: retrieve_matrix<4>( cur, data, n ); break;
+            case 5: retrieve_matrix<5>( cur, data, n ); break;
+            case 6: retrieve_matrix<6>( cur, data, n ); break;
+            case 7: retrieve_matrix<7>( cur, data, n ); break;
+            case 8: retrieve_matrix<8>( cur, data, n ); break;
+            default: die("Unsupported matrix encoding");
+        }
+        return;
+    }
+
+    switch( header.bits ) {
+        case 1: retrieve_block<1>( cur, data, n ); break;
+        case 2: retrieve_block<2>( cur, data, n ); break;
+        case 3: retrieve_block<3>( cur, data, n ); break;
+        case 4: retrieve_block<4>( cur, data, n ); break;
+        case 5: retrieve_block<5>( cur, data, n ); break;
+        case 6: retrieve_block<6>( cur, data, n ); break;
+        case 7: retrieve_block<7>( cur, data, n ); break;
+        case 8: retrieve_block<8>( cur, data, n ); break;
+        default: die("Unsupported number of bits per channel");
+    }
+}
+
+/* largest block of file data, no bigger than the buffer, which holds whole
+ * groups of bytes at the number of bits per channel (or per block of matrix
+ * encoded channels) recorded in the header */
+size_t
+block_size ( const std::vector<BYTE> &buffer, const Header &header ) {
+    return buffer.size() - buffer.size() % GROUP_BYTES(header.bits);
+}
+
+/* number of channels occupied by a header, from the start of the image */
+LONG
+header_channels ( const Header &header ) {
+    LONG bytes = sizeof(BYTE) + header.fname.length() + sizeof(LONG);
+    if( header.flags ) {
+        bytes += sizeof(BYTE) + sizeof(BYTE);
+    }
+    if( header.flags & (FLAG_BITS | FLAG_MATRIX) ) {
+        bytes += sizeof(BYTE);
+    }
+    if( header.flags & FLAG_COMPRESSED ) {
+        bytes += sizeof(BYTE) + sizeof(BYTE);
+    }
+    if( header.flags & FLAG_ENCRYPTED ) {
+        bytes += sizeof(BYTE);
+    }
+    if( header.flags & KEYED_FLAGS ) {
+        bytes += SALT_BYTES;
+    }
+    if( header.flags & FLAG_SHARD ) {
+        bytes += sizeof(BYTE) + SHARD_SET_BYTES + 2*SHARD_INDEX_BYTES + 
+            2*sizeof(LONG);
+        if( header.scheme == SHARD_REED_SOLOMON ) {
+            bytes += SHARD_INDEX_BYTES;
+        }
+    }
+    return CHANNELS_TO_ENCODE(bytes);
+}
+
+/* pixel at which the file data begins in an image using an extended header.
+ * The data starts on a fresh pixel so that it may be laid out in any order
+ * without overlapping the header */
+LONG
+data_start ( const ChannelCursor &cur, const Header &header ) {
+    return (header_channels( header ) + cur.spectrum - 1)/cur.spectrum;
+}
+
+/* number of bytes embedded after the file data */
+LONG
+trailer_bytes ( const Header &header ) {
+    return (header.flags & FLAG_CHECKSUM)? CHECKSUM_BYTES : 0;
+}
+
+/* number of bytes which are embedded for a file which isn't compressed,
+ * counting the trailer and the framing added by encryption */
+LONG
+stream_bytes ( const Header &header ) {
+    LONG bytes = header.fsize + trailer_bytes( header );
+    return (header.flags & FLAG_ENCRYPTED)? sealed_size( bytes ) : bytes;
+}
+
+/* most bytes that a file (or part of one) of header.fsize bytes could take
+ * up once embedded. Deflate can make data which doesn't compress a little
+ * bigger, so a compressed file is allowed for at its worst */
+LONG
+most_stream_bytes( Header header ) {
+    if( header.flags & FLAG_COMPRESSED ) {
+        header.fsize = compressBound( header.fsize );
+    }
+    return stream_bytes( header );
+}
+
+/* number of bytes of file data which can be stored in an image alongside the
+ * given header. An image has a capacity that is equal to its area times the
+ * number of channels per pixel times the number of bits we are storing per
+ * channel. This yields a capacity in bits. We divide by the size of a byte (our
+ * smallest unit of storage) to get the capacity in bytes, and discount
+ * whatever is taken up by the header */
+LONG
+data_capacity ( const ChannelCursor &cur, const Header &header ) {
+    LONG pixels = cur.pixels;
+    LONG channels;
+
+    if( header.flags & FLAG_SCATTER ) {
+        LONG start = data_start( cur, header );
+        channels = scatter_pixels( pixels, start ) * cur.spectrum;
+    } else if( header.flags ) {
+        LONG start = data_start( cur, header );
+        channels = (pixels > start)? (pixels - start) * cur.spectrum : 0;
+    } else {
+        LONG used = header_channels( header );
+        channels = pixels * cur.spectrum;
+        channels = (channels > used)? channels - used : 0;
+    }
+
+    /* matrix encoding stores its bits in whole blocks of channels */
+    if( header.flags & FLAG_MATRIX ) {
+        channels /= MATRIX_CHANNELS(header.bits);
+    }
+    return (channels * header.bits)/BYTES_TO_BITS(sizeof(BYTE));
+}
+
+/* move a cursor which has just passed over the header to the channel where
+ * the file data begins. Images using the original layout carry on directly
+ * after the header. Otherwise the data starts on a fresh pixel, laid out in
+ * the order recorded in the header */
+void
+seek_data ( ChannelCursor &cur, const Header &header ) {
+    if( !header.flags ) {
+        return;
+    }
+
+    LONG start = data_start( cur, header );
+    if( header.flags & FLAG_PLANAR ) {
+        if( !cur.img ) {
+            die("Unable to stream an image embedded one plane at a time");
+        }
+        flush( cur );
+        init_cursor( cur, cur.img, PLANAR, start );
+    } else {
+        cur.pix     = start;
+        cur.channel = 0;
+    }
+}
+
+/* embed a header at the start of the image. The cursor should be positioned
+ * at the first channel of the image, and is left just after the header */
+void
+embed_header ( ChannelCursor &cur, const Header &header ) {
+
+    /* images using the original layout need no flags, so the header is left
+     * exactly as older versions of the program expect to find it */
+    if( header.flags ) {
+        embed( cur, HEADER_EXTENDED, sizeof(BYTE) );
+        embed( cur, header.flags, sizeof(BYTE) );
+    }
+    if( header.flags & (FLAG_BITS | FLAG_MATRIX) ) {
+        embed( cur, header.bits, sizeof(BYTE) );
+    }
+    if( header.flags & FLAG_COMPRESSED ) {
+        embed( cur, header.codec, sizeof(BYTE) );
+        embed( cur, header.level, sizeof(BYTE) );
+    }
+    if( header.flags & FLAG_ENCRYPTED ) {
+        embed( cur, header.cipher, sizeof(BYTE) );
+    }
+    if( header.flags & KEYED_FLAGS ) {
+        for( int i=0; i<SALT_BYTES; i++ ) {
+            embed( cur, header.salt[i], sizeof(BYTE) );
+        }
+    }
+    if( header.flags & FLAG_SHARD ) {
+        embed( cur, header.scheme, sizeof(BYTE) );
+        embed( cur, header.set, SHARD_SET_BYTES );
+        embed( cur, header.shard, SHARD_INDEX_BYTES );
+        embed( cur, header.shards, SHARD_INDEX_BYTES );
+        if( header.scheme == SHARD_REED_SOLOMON ) {
+            embed( cur, header.needed, SHARD_INDEX_BYTES );
+        }
+        embed( cur, header.offset, sizeof(LONG) );
+        embed( cur, header.total, sizeof(LONG) );
+    }
+
+    /* embed the filename and the filename length in the image */
+    embed( cur, header.fname.length(), sizeof(BYTE) );
+    for( LONG i=0; i<header.fname.length(); i++ ) {
+        embed( cur, header.fname[i], sizeof(CHAR) );
+    }
+
+    /* embed file size in the image */
+    embed( cur, header.fsize, sizeof(LONG) );
+}
+
+/* retrieve the header from the start of the image. The cursor should be
+ * positioned at the first channel of the image, and is left just after the
+ * header */
+void
+retrieve_header ( ChannelCursor &cur, Header &header ) {
+
+    /* retrieve information about the file we are about to load - file size
+     * file name and the length of the file name */
+    header.flags = 0;
+    header.bits  = ENCODE_BITS_PER_CHANNEL;
+    header.codec = CODEC_NONE;
+    header.level = 0;
+    header.cipher = 0;
+    header.scheme = 0;
+    BYTE fname_len = retrieve( cur, sizeof(BYTE) );
+    if( fname_len == HEADER_EXTENDED ) {
+        header.flags = retrieve( cur, sizeof(BYTE) );
+        if( !header.flags || (header.flags & ~SUPPORTED_FLAGS) ) {
+            die("Image uses an unsupported header");
+        }
+        if( header.flags & FLAG_BITS ) {
+            header.bits = retrieve( cur, sizeof(BYTE) );
+            if( header.bits < MIN_BITS_PER_CHANNEL || 
+                    header.bits > MAX_BITS_PER_CHANNEL ||
+                    (header.flags & FLAG_MATRIX) ) {
+                die("Image uses an unsupported header");
+            }
+        } else if( header.flags & FLAG_MATRIX ) {
+            header.bits = retrieve( cur, sizeof(BYTE) );
+            if( header.bits < MIN_MATRIX_BITS || 
+                    header.bits > MAX_MATRIX_BITS ) {
+                die("Image uses an unsupported header");
+            }
+        }
+        if( header.flags & FLAG_COMPRESSED ) {
+            header.codec = retrieve( cur, sizeof(BYTE) );
+            header.level = retrieve( cur, sizeof(BYTE) );
+            if( header.codec != CODEC_DEFLATE ) {
+                die("Image uses an unsupported header");
+            }
+        }
+        if( header.flags & FLAG_ENCRYPTED ) {
+            header.cipher = retrieve( cur, sizeof(BYTE) );
+            if( header.cipher != CIPHER_CHACHA20_POLY1305 ) {
+                die("Image uses an unsupported header");
+            }
+        }
+        if( header.flags & KEYED_FLAGS ) {
+            for( int i=0; i<SALT_BYTES; i++ ) {
+                header.salt[i] = retrieve( cur, sizeof(BYTE) );
+            }
+        }
+        if( header.flags & FLAG_SHARD ) {
+            header.scheme = retrieve( cur, sizeof(BYTE) );
+            header.set    = retrieve( cur, SHARD_SET_BYTES );
+            header.shard  = retrieve( cur, SHARD_INDEX_BYTES );
+            header.shards = retrieve( cur, SHARD_INDEX_BYTES );
+            header.needed = header.shards;
+            if( header.scheme == SHARD_REED_SOLOMON ) {
+                header.needed = retrieve( cur, SHARD_INDEX_BYTES );
+            }
+            header.offset = retrieve( cur, sizeof(LONG) );
+            header.total  = retrieve( cur, sizeof(LONG) );
+            if( (header.scheme != SHARD_SPLIT && 
+                        header.scheme != SHARD_REED_SOLOMON) || 
+                    header.shard >= header.shards || !header.needed ||
+                    header.needed > header.shards ||
+                    (header.scheme == SHARD_REED_SOLOMON && 
+                     header.shards > MAX_CODED_SHARDS) ) {
+                die("Image uses an unsupported header");
+            }
+        }
+        fname_len = retrieve( cur, sizeof(BYTE) );
+    }
+
+    header.fname.clear();
+    for( int i=0; i<fname_len; i++ ) {
+        char c = retrieve( cur, sizeof(CHAR) );
+        header.fname += c;
+    }
+    header.fsize = retrieve( cur, sizeof(LONG) );
+
+    if( header.scheme == SHARD_SPLIT && (header.offset > header.total ||
+                header.fsize > header.total - header.offset) ) {
+        die("Image does not contain embedded data");
+    }
+    if( header.scheme == SHARD_REED_SOLOMON && 
+            (header.fsize > UINT64_MAX / header.shards ||
+             header.offset != header.shard * header.fsize ||
+             header.total > header.needed * header.fsize) ) {
+        die("Image does not contain embedded data");
+    }
+
+    /* the size is that of the file before compression, which may well be
+     * more than the image could hold */
+    if( !(header.flags & FLAG_COMPRESSED) && 
+            stream_bytes( header ) > data_capacity( cur, header ) ) {
+        die("Image does not contain embedded data");
+    }
+}
+
+/* subtract one image from another, showing how much the low bits of each
+ * channel differ scaled up to the brightest value in the image. Channels
+ * which differ by more than the low bits can hold are shown at full
+ * brightness. CImg holds an image one plane after another, so both images
+ * are walked straight through and every possible difference is scaled up
+ * front */
+void
+subtract_images ( cimg_library::CImg<CHANNEL> &img,  
+        cimg_library::CImg<CHANNEL> &sub,
+        cimg_library::CImg<CHANNEL> &result ) {
+    CHANNEL table[16];
+   
+    unsigned int max = img.max(); 
+    for( unsigned int d=0; d<16; d++ ) {
+        table[d] = std::min( d, (unsigned int) CHANNEL_BIT_MASK ) * max / 
+            CHANNEL_BIT_MASK;
+    }
+
+    /* when asked to use several threads, each takes a share of the image */
+    size_t n = img.size();
+    int parts = (g_threads > 1)? worker_count() : 1;
+    auto task = [&]( int part ) {
+        size_t begin = n * part / parts;
+        size_t end   = n * (part + 1) / parts;
+        diff_channels( result.data() + begin, img.data() + begin, 
+                sub.data() + begin, table, end - begin );
+    };
+
+    if( parts > 1 ) {
+        run_parallel( parts, task );
+    } else {
+        task( 0 );
+    }
+}
+
+/* build the header describing a file which is about to be embedded */
+Header
+file_header( const Payload &payload, std::string filename ) {
+    Header header;
+
+    /* strip away any path information from our filename in a platform
+     * undependent way */
+    boost::filesystem::path p(filename);
+    header.fname = p.filename().string();
+    header.fsize = payload.size;
+    header.flags = (g_order == PLANAR)? FLAG_PLANAR : 0;
+    header.bits  = g_bits;
+    if( g_bits != ENCODE_BITS_PER_CHANNEL ) {
+        header.flags |= FLAG_BITS;
+    }
+    header.codec = CODEC_NONE;
+    header.level = g_level;
+    if( g_level ) {
+        header.flags |= FLAG_COMPRESSED;
+        header.codec  = CODEC_DEFLATE;
+    }
+    if( g_checksum ) {
+        header.flags |= FLAG_CHECKSUM;
+    }
+    header.cipher = 0;
+    if( !g_passphrase.empty() ) {
+        header.flags |= FLAG_ENCRYPTED;
+        header.cipher = CIPHER_CHACHA20_POLY1305;
+    }
+    if( g_matrix ) {
+        if( g_bits != ENCODE_BITS_PER_CHANNEL ) {
+            die("A matrix encoded file is stored one bit to a channel, so "
+                    "-m can't be used with -b");
+        }
+        header.flags |= FLAG_MATRIX;
+        header.bits   = g_matrix;
+    }
+    if( g_scatter ) {
+        if( g_passphrase.empty() ) {
+            die("Scattering a file needs a passphrase, given with -k");
+        }
+        if( g_order == PLANAR ) {
+            die("A scattered file can't also be laid out one plane at a time");
+        }
+        header.flags |= FLAG_SCATTER;
+    }
+    if( (header.flags & KEYED_FLAGS) && !random_salt( header.salt ) ) {
+        die("Unable to generate a salt");
+    }
+
+    if( header.fname.length() > UCHAR_MAX ) {
+        die("Filename too long to embed");
+    }
+
+    return header;
+}
+
+/* before we start writing data to the image, make sure it is large enough to
+ * store the embedded data. If requirements exceed available resources then
+ * the program fails. The size of a compressed file isn't known until it has
+ * been compressed, so it is checked as it is embedded instead */
+void
+check_capacity( const ChannelCursor &cur, const Header &header ) {
+    if( !(header.flags & FLAG_COMPRESSED) && 
+            stream_bytes( header ) > data_capacity( cur, header ) ) {
+        die("Image not large enough to embed data");
+    }
+}
+
+/* file data on its way into the image. Data can be handed to the sink in
+ * runs of any length: whole groups of bytes are embedded as they arrive,
+ * while a part group at the end of a run is carried over until the next run
+ * completes it, so that nothing is padded out before the end. An encrypted
+ * file is gathered up a frame at a time and sealed first, and the frames
+ * are embedded a buffer at a time so that they can be spread across the
+ * worker threads */
+struct DataSink {
+    ChannelCursor *cur;
+    const Header  *header;
+    LONG   capacity;    /* bytes which can be embedded in all */
+    LONG   embedded;    /* bytes embedded so far, counting those carried */
+    BYTE   carry[MAX_BITS_PER_CHANNEL]; /* part group waiting to be embedded */
+    size_t carried;
+    Cipher *cipher;     /* seals the data first, if the file is encrypted */
+    std::vector<BYTE> plain;  /* data waiting to be sealed into a frame */
+    std::vector<BYTE> sealed; /* frames waiting to be embedded */
+};
+
+void
+init_sink ( DataSink &sink, ChannelCursor &cur, const Header &header,
+        Cipher *cipher ) {
+    sink.cur      = &cur;
+    sink.header   = &header;
+    sink.capacity = data_capacity( cur, header );
+    sink.embedded = 0;
+    sink.carried  = 0;
+    sink.cipher   = cipher;
+    sink.plain.clear();
+    sink.sealed.clear();
+    if( cipher ) {
+        sink.plain.reserve( FRAME_DATA );
+        sink.sealed.reserve( std::max( io_buffer().size(),
+                    (size_t) FRAME_DATA + FRAME_OVERHEAD ) );
+    }
+}
+
+/* embed a run of bytes as they are, carrying over any part group at the end
+ * of the run */
+void
+embed_run ( DataSink &sink, const BYTE *data, size_t n ) {
+    const size_t group = GROUP_BYTES(sink.header->bits);
+
+    if( sink.embedded + n > sink.capacity ) {
+        die("Image not large enough to embed data");
+    }
+    sink.embedded += n;
+
+    if( sink.carried ) {
+        size_t take = std::min( n, group - sink.carried );
+        memcpy( sink.carry + sink.carried, data, take );
+        sink.carried += take;
+        data += take;
+        n    -= take;
+        if( sink.carried < group ) {
+            return;
+        }
+        embed_data( *sink.cur, *sink.header, sink.carry, group );
+        sink.carried = 0;
+    }
+
+    size_t tail = n % group;
+    if( n > tail ) {
+        embed_data( *sink.cur, *sink.header, data, n - tail );
+    }
+    memcpy( sink.carry, data + n - tail, tail );
+    sink.carried = tail;
+}
+
+/* seal the data gathered so far into a frame, and embed the frames sealed so
+ * far once there mightn't be room for another */
+void
+seal_plain ( DataSink &sink, bool last ) {
+    size_t n = sink.plain.size();
+    size_t at = sink.sealed.size();
+
+    sink.sealed.resize( at + n + FRAME_OVERHEAD );
+    if( !seal_frame( *sink.cipher, sink.plain.data(), n, last,
+                sink.sealed.data() + at ) ) {
+        die("Unable to encrypt file to embed");
+    }
+    sink.plain.clear();
+
+    if( last || sink.sealed.size() + FRAME_DATA + FRAME_OVERHEAD > 
+            sink.sealed.capacity() ) {
+        embed_run( sink, sink.sealed.data(), sink.sealed.size() );
+        sink.sealed.clear();
+    }
+}
+
+/* hand a run of file data to the sink */
+void
+sink_write ( DataSink &sink, const BYTE *data, size_t n ) {
+    if( !sink.cipher ) {
+        embed_run( sink, data, n );
+        return;
+    }
+
+    while( n ) {
+        size_t take = std::min( n, FRAME_DATA - sink.plain.size() );
+        sink.plain.insert( sink.plain.end(), data, data + take );
+        data += take;
+        n    -= take;
+        if( sink.plain.size() == FRAME_DATA ) {
+            seal_plain( sink, false );
+        }
+    }
+}
+
+/* embed whatever the sink is still holding on to, once all of the file data
+ * has been handed to it */
+void
+finish_sink ( DataSink &sink ) {
+    if( sink.cipher ) {
+        seal_plain( sink, true );
+    }
+    if( sink.carried ) {
+        embed_data( *sink.cur, *sink.header, sink.carry, sink.carried );
+        sink.carried = 0;
+    }
+}
+
+/* hand the checksum of the file to the sink, if the header calls for one,
+ * and embed whatever the sink is still holding on to */
+void
+finish_file ( DataSink &sink, uint32_t crc ) {
+    if( sink.header->flags & FLAG_CHECKSUM ) {
+        BYTE trailer[CHECKSUM_BYTES];
+        store_group( trailer, crc, CHECKSUM_BYTES );
+        sink_write( sink, trailer, CHECKSUM_BYTES );
+    }
+    finish_sink( sink );
+}
+
+/* embed the contents of a file compressed with deflate. The file is
+ * compressed a buffer at a time as it is embedded, so neither the file nor
+ * the compressed data is ever held in memory in full. Each time the buffer
+ * of compressed data fills up it is handed to the sink in one go, so that it
+ * can be spread across the worker threads */
+void
+embed_compressed( DataSink &sink, Payload &payload, const Header &header ) {
+    std::vector<BYTE> input( IO_BUFFER_SIZE );
+    std::vector<BYTE> &buffer = io_buffer();
+    size_t block = block_size( buffer, header );
+    LONG remaining = header.fsize;
+    size_t pending = 0;
+    uint32_t crc = 0;
+    z_stream zs;
+
+    memset( &zs, 0, sizeof(zs) );
+    if( deflateInit( &zs, header.level ) != Z_OK ) {
+        die("Unable to compress file to embed");
+    }
+
+    try {
+        for( bool done = false; !done; ) {
+            if( !zs.avail_in && remaining ) {
+                const BYTE *data;
+                size_t n = read_block( payload, input, input.size(), data );
+                if( !n ) {
+                    die("Unable to read file to embed");
+                }
+                zs.next_in  = (Bytef *) data;
+                zs.avail_in = n;
+                remaining  -= n;
+                crc = crc32c( crc, data, n );
+            }
+
+            zs.next_out  = buffer.data() + pending;
+            zs.avail_out = block - pending;
+            int ret = deflate( &zs, remaining? Z_NO_FLUSH : Z_FINISH );
+            if( ret == Z_STREAM_ERROR ) {
+                die("Unable to compress file to embed");
+            }
+            pending = block - zs.avail_out;
+            done = (ret == Z_STREAM_END);
+
+            if( pending == block || done ) {
+                sink_write( sink, buffer.data(), pending );
+                pending = 0;
+            }
+        }
+        finish_file( sink, crc );
+    } catch ( StegError &e ) {
+        deflateEnd( &zs );
+        throw;
+    }
+    deflateEnd( &zs );
+}
+
+/* embed the contents of a file as they are, a block at a time. The checksum
+ * is taken of each block just before it is embedded, while it is still to
+ * hand, so the file is only ever read once */
+void
+embed_plain( DataSink &sink, Payload &payload, const Header &header ) {
+    std::vector<BYTE> &buffer = io_buffer();
+    size_t block = block_size( buffer, header );
+    uint32_t crc = 0;
+
+    for( LONG remaining = header.fsize; remaining; ) {
+        const BYTE *data;
+        size_t n = read_block( payload, buffer, block, data );
+        if( !n ) {
+            die("Unable to read file to embed");
+        }
+        crc = crc32c( crc, data, n );
+        sink_write( sink, data, n );
+        remaining -= n;
+    } 
+    finish_file( sink, crc );
+}
+
+/* derive the keys the header calls for from the passphrase, setting up the
+ * cipher if the file is encrypted and the shuffle if it is scattered. The
+ * cursor should be positioned where the file data begins. Returns the
+ * cipher, or NULL if the file isn't encrypted */
+Cipher *
+open_keys( ChannelCursor &cur, const Header &header, Cipher &cipher,
+        Scatter &scatter ) {
+    BYTE keys[CIPHER_KEY_BYTES + SCATTER_KEY_BYTES];
+
+    if( !(header.flags & KEYED_FLAGS) ) {
+        return NULL;
+    }
+    if( g_passphrase.empty() ) {
+        die("Embedded file is encrypted, give its passphrase with -k");
+    }
+    if( !derive_keys( g_passphrase, header.salt, keys, sizeof(keys) ) ) {
+        die("Unable to derive a key from the passphrase");
+    }
+
+    if( header.flags & FLAG_SCATTER ) {
+        init_scatter( scatter, keys + CIPHER_KEY_BYTES, cur.pixels, 
+                cur.spectrum, data_start( cur, header ) );
+        cur.scatter = &scatter;
+        cur.symbol  = 0;
+    }
+
+    bool opened = (header.flags & FLAG_ENCRYPTED) && 
+        open_cipher( cipher, keys );
+    memset( keys, 0, sizeof(keys) );
+    if( (header.flags & FLAG_ENCRYPTED) && !opened ) {
+        close_cipher( cipher );
+        die("Unable to set up decryption");
+    }
+    return opened? &cipher : NULL;
+}
+
+/* embed the header followed by the contents of the file, starting from a
+ * cursor positioned at the first channel of the image */
+void
+embed_file( ChannelCursor &cur, Payload &payload, const Header &header ) {
+    Cipher cipher;
+    Scatter scatter;
+    DataSink sink;
+
+    embed_header( cur, header );
+    seek_data( cur, header );
+
+    try {
+        init_sink( sink, cur, header, 
+                open_keys( cur, header, cipher, scatter ) );
+        if( header.flags & FLAG_COMPRESSED ) {
+            embed_compressed( sink, payload, header );
+        } else {
+            embed_plain( sink, payload, header );
+        }
+    } catch ( StegError &e ) {
+        cur.scatter = NULL;
+        close_cipher( cipher );
+        throw;
+    }
+    cur.scatter = NULL;
+    close_cipher( cipher );
+}
+
+void
+embed_file_in_image( Payload &payload, const Header &header, 
+        cimg_library::CImg<CHANNEL> *img ) {
+    ChannelCursor cur;
+
+    init_cursor( cur, img, INTERLEAVED, 0 );
+    check_capacity( cur, header );
+    embed_file( cur, payload, header );
+    flush( cur );
+}
+
+/* embed a file in an image without holding the whole image in memory. Rows of
+ * the image are read, have file data embedded in them and are written to the
+ * output image one at a time. Returns false without writing anything if the
+ * images can't be handled this way, in which case the caller should fall back
+ * to loading the image in full */
+bool
+embed_file_in_stream( Payload &payload, const Header &header, 
+        const char *image_name, const char *output_name ) {
+    RowReader rows;
+    RowWriter out;
+    ChannelCursor cur;
+
+    /* data embedded one plane at a time or scattered is spread through the
+     * whole image, and we can't overwrite the image while we are still
+     * reading from it. Matrix encoding may have to go back a row to change
+     * a channel in a block which straddles two rows. Rows are also dealt
+     * with one at a time, so when asked to use several threads we hold the
+     * whole image in memory instead */
+    boost::system::error_code ec;
+    if( (header.flags & (FLAG_PLANAR | FLAG_SCATTER | FLAG_MATRIX)) || 
+            g_threads > 1 ||
+            boost::filesystem::equivalent( image_name, output_name, ec ) ) {
+        return false;
+    }
+
+    if( !open_rows( rows, image_name ) ) {
+        return false;
+    }
+
+    bool created = false;
+    try {
+        init_cursor( cur, &rows );
+        check_capacity( cur, header );
+
+        created = create_rows( out, output_name, rows.width, rows.height, 
+                rows.spectrum );
+        if( !created ) {
+            close_rows( rows );
+            return false;
+        }
+
+        cur.out = &out;
+        embed_file( cur, payload, header );
+        finish_rows( cur );
+    } catch ( StegError &e ) {
+        /* don't leave a partly written image behind */
+        close_rows( rows );
+        close_rows( out );
+        if( created ) {
+            std::remove( output_name );
+        }
+        throw;
+    }
+
+    close_rows( rows );
+    if( !close_rows( out ) ) {
+        std::ostringstream oss;
+        oss << "unable to write " << output_name;
+        die(oss.str());
+    }
+    return true;
+}
+
+/* the file an image is embedded into where it lies. Usually that is the
+ * output image, started off as a copy of the image being embedded in, or the
+ * image itself if the two are one and the same. A file which may yet turn
+ * out too large for the image once it is partly embedded (a compressed one)
+ * can't be embedded into the image itself, as it would be left half
+ * written, so it is embedded into a copy beside the image instead, which
+ * only replaces the image once the whole file is in */
+struct Carrier {
+    std::string temp;   /* the copy beside the image, if there is one */
+    const char *target; /* the file to embed into */
+    bool copied;        /* target was created here, and can be removed */
+};
+
+/* set up the file to embed into. fits says whether the file is sure to fit
+ * in the image */
+void
+open_carrier( Carrier &carrier, const char *image_name, 
+        const char *output_name, bool fits ) {
+    boost::system::error_code ec;
+
+    carrier.target = output_name;
+    carrier.copied = !boost::filesystem::equivalent( image_name, output_name,
+            ec );
+    if( !carrier.copied && !fits ) {
+        carrier.temp = boost::filesystem::unique_path(
+                std::string( output_name ) + ".%%%%%%%%" ).string();
+        carrier.target = carrier.temp.c_str();
+        carrier.copied = true;
+    }
+    if( !carrier.copied ) {
+        return;
+    }
+
+    if( !copy_file( image_name, carrier.target ) ) {
+        std::remove( carrier.target );
+        std::ostringstream oss;
+        oss << "unable to write " << output_name;
+        die(oss.str());
+    }
+    if( !carrier.temp.empty() ) {
+        boost::filesystem::permissions( carrier.temp,
+                boost::filesystem::status( image_name, ec ).permissions(),
+                ec );
+    }
+}
+
+/* throw away whatever has been embedded, leaving the output image as it was
+ * before, or gone if it was created here */
+void
+discard_carrier( Carrier &carrier ) {
+    if( carrier.copied ) {
+        std::remove( carrier.target );
+    }
+}
+
+/* put a copy beside the image in place of it once the whole file has been
+ * embedded. Returns false, having discarded the copy, if it can't be */
+bool
+finish_carrier( Carrier &carrier, const char *output_name ) {
+    if( !carrier.temp.empty() && 
+            std::rename( carrier.target, output_name ) != 0 ) {
+        discard_carrier( carrier );
+        return false;
+    }
+    return true;
+}
+
+/* embed a file in a binary PPM/PGM or PAM image by mapping a copy of the image
+ * into memory and embedding straight into its raster, so the image is never
+ * decoded or encoded. Returns false without writing anything if the images
+ * can't be handled this way, in which case the caller should fall back to
+ * one of the other methods */
+bool
+embed_file_in_raster( Payload &payload, const Header &header, 
+        const char *image_name, const char *output_name ) {
+    Raster raster;
+    ChannelCursor cur;
+
+    /* data embedded one plane at a time would have to be scattered through
+     * the raster a channel at a time */
+    if( header.flags & FLAG_PLANAR ) {
+        return false;
+    }
+
+    if( !open_raster( raster, image_name, false ) ) {
+        return false;
+    }
+    if( !raster_matches( raster, output_name ) ) {
+        close_raster( raster );
+        return false;
+    }
+
+    bool fits;
+    try {
+        init_cursor( cur, &raster );
+        check_capacity( cur, header );
+        fits = most_stream_bytes( header ) <= data_capacity( cur, header );
+    } catch ( StegError &e ) {
+        close_raster( raster );
+        throw;
+    }
+    close_raster( raster );
+
+    Carrier carrier;
+    open_carrier( carrier, image_name, output_name, fits );
+    if( !open_raster( raster, carrier.target, true ) ) {
+        discard_carrier( carrier );
+        std::ostringstream oss;
+        oss << "unable to map " << output_name;
+        die(oss.str());
+    }
+
+    try {
+        init_cursor( cur, &raster );
+        embed_file( cur, payload, header );
+    } catch ( StegError &e ) {
+        /* don't leave a partly written image behind */
+        close_raster( raster );
+        discard_carrier( carrier );
+        throw;
+    }
+
+    bool closed = close_raster( raster );
+    if( !closed ) {
+        discard_carrier( carrier );
+    }
+    if( !closed || !finish_carrier( carrier, output_name ) ) {
+        std::ostringstream oss;
+        oss << "unable to write " << output_name;
+        die(oss.str());
+    }
+    return true;
+}
+
+/* embed a file in an uncompressed BMP image by patching the rows the file
+ * occupies in a copy of the image. Nothing else in the image is read or
+ * rewritten, so the work done depends only on the size of the file. Returns
+ * false without writing anything if the images can't be handled this way */
+bool
+embed_file_in_patch( Payload &payload, const Header &header, 
+        const char *image_name, const char *output_name ) {
+    PatchFile patch;
+    ChannelCursor cur;
+
+    /* data embedded one plane at a time, or scattered, is spread through
+     * every row */
+    if( header.flags & (FLAG_PLANAR | FLAG_SCATTER) ) {
+        return false;
+    }
+
+    if( !open_patch( patch, image_name, false ) ) {
+        return false;
+    }
+    if( !patch_matches( patch, output_name ) ) {
+        close_patch( patch );
+        return false;
+    }
+
+    bool fits;
+    try {
+        init_cursor( cur, &patch );
+        check_capacity( cur, header );
+        fits = most_stream_bytes( header ) <= data_capacity( cur, header );
+    } catch ( StegError &e ) {
+        close_patch( patch );
+        throw;
+    }
+    close_patch( patch );
+
+    Carrier carrier;
+    open_carrier( carrier, image_name, output_name, fits );
+    if( !open_patch( patch, carrier.target, true ) ) {
+        discard_carrier( carrier );
+        std::ostringstream oss;
+        oss << "unable to open " << output_name;
+        die(oss.str());
+    }
+
+    try {
+        init_cursor( cur, &patch );
+        embed_file( cur, payload, header );
+        flush( cur );
+    } catch ( StegError &e ) {
+        /* don't leave a partly written image behind */
+        close_patch( patch );
+        discard_carrier( carrier );
+        throw;
+    }
+
+    bool closed = close_patch( patch );
+    if( !closed ) {
+        discard_carrier( carrier );
+    }
+    if( !closed || !finish_carrier( carrier, output_name ) ) {
+        std::ostringstream oss;
+        oss << "unable to write " << output_name;
+        die(oss.str());
+    }
+    return true;
+}
+
+/* write a buffer of retrieved data to the output file */
+void
+write_output( int out, const BYTE *data, size_t n, const char *name ) {
+    if( !write_fully( out, data, n ) ) {
+        std::ostringstream oss;
+        oss << "Unable to write to " << name;
+        die(oss.str());
+    }
+}
+
+/* file data on its way out of the image. This is the counterpart of
+ * DataSink: data can be taken from the source in runs of any length, with
+ * whole groups of bytes retrieved straight into the caller's buffer and a
+ * group which straddles the end of a run kept back for the next. An
+ * encrypted file is retrieved a buffer of frames at a time, and no data is
+ * handed out from a frame until the whole frame has been opened */
+struct DataSource {
+    ChannelCursor *cur;
+    const Header  *header;
+    LONG   limit;       /* bytes which can be retrieved in all */
+    LONG   retrieved;   /* bytes retrieved so far, counting those carried */
+    BYTE   carry[MAX_BITS_PER_CHANNEL]; /* group not yet handed out in full */
+    size_t carried;
+    size_t carry_pos;
+    Cipher *cipher;     /* opens the frames, if the file is encrypted */
+    std::vector<BYTE> sealed; /* frames retrieved but not yet opened */
+    size_t sealed_pos;
+    std::vector<BYTE> plain;  /* data from the frame opened last */
+    size_t plain_len;
+    size_t plain_pos;
+    bool   last;        /* the frame opened last was the last frame */
+};
+
+/* set up a source for the data following a header. The amount of data
+ * embedded is known unless the file was compressed, in which case retrieval
+ * is only limited by the size of the image */
+void
+init_source ( DataSource &src, ChannelCursor &cur, const Header &header,
+        Cipher *cipher ) {
+    src.cur        = &cur;
+    src.header     = &header;
+    src.limit      = (header.flags & FLAG_COMPRESSED)? 
+        data_capacity( cur, header ) : stream_bytes( header );
+    src.retrieved  = 0;
+    src.carried    = 0;
+    src.carry_pos  = 0;
+    src.cipher     = cipher;
+    src.sealed_pos = 0;
+    src.plain_len  = 0;
+    src.plain_pos  = 0;
+    src.last       = false;
+    src.sealed.clear();
+    src.plain.clear();
+    if( cipher ) {
+        src.sealed.reserve( std::max( io_buffer().size(),
+                    (size_t) FRAME_DATA + FRAME_OVERHEAD ) );
+        src.plain.resize( FRAME_DATA );
+    }
+}
+
+/* retrieve a run of up to n bytes as they are. Returns the number of bytes
+ * retrieved, which is less than n only once the limit has been reached */
+size_t
+retrieve_run ( DataSource &src, BYTE *data, size_t n ) {
+    const size_t group = GROUP_BYTES(src.header->bits);
+    size_t got = 0;
+
+    size_t take = std::min( n, src.carried - src.carry_pos );
+    memcpy( data, src.carry + src.carry_pos, take );
+    src.carry_pos += take;
+    got += take;
+
+    size_t whole = std::min( (LONG) (n - got), src.limit - src.retrieved );
+    whole -= whole % group;
+    if( whole ) {
+        retrieve_data( *src.cur, *src.header, data + got, whole );
+        src.retrieved += whole;
+        got += whole;
+    }
+
+    /* a group straddling the end of the run. At the limit there may be less
+     * than a whole group left, which is all that was embedded */
+    if( got < n && src.retrieved < src.limit ) {
+        src.carried = std::min( (LONG) group, src.limit - src.retrieved );
+        retrieve_data( *src.cur, *src.header, src.carry, src.carried );
+        src.retrieved += src.carried;
+
+        src.carry_pos = std::min( n - got, src.carried );
+        memcpy( data + got, src.carry, src.carry_pos );
+        got += src.carry_pos;
+    }
+    return got;
+}
+
+/* make sure that at least need bytes of frames are waiting to be opened,
+ * retrieving as many more as will fit if not. Returns false if there aren't
+ * that many left to retrieve */
+bool
+fill_sealed ( DataSource &src, size_t need ) {
+    size_t have = src.sealed.size() - src.sealed_pos;
+    if( have >= need ) {
+        return true;
+    }
+
+    src.sealed.erase( src.sealed.begin(), 
+            src.sealed.begin() + src.sealed_pos );
+    src.sealed_pos = 0;
+    src.sealed.resize( src.sealed.capacity() );
+    have += retrieve_run( src, src.sealed.data() + have, 
+            src.sealed.size() - have );
+    src.sealed.resize( have );
+    return have >= need;
+}
+
+/* open the next frame, ready to hand out the data it holds */
+void
+open_next ( DataSource &src ) {
+    if( !fill_sealed( src, FRAME_LENGTH_BYTES ) ) {
+        die("Embedded data is corrupt");
+    }
+
+    /* the length is authenticated along with the frame, so one which is out
+     * of range is as much a sign of the wrong passphrase as a bad tag. It
+     * is what a scattered image retrieved with the wrong passphrase yields,
+     * as its frames are then gathered from the wrong channels */
+    const BYTE *frame = src.sealed.data() + src.sealed_pos;
+    size_t n = frame_length( frame, src.last );
+    bool whole = n <= FRAME_DATA && fill_sealed( src, n + FRAME_OVERHEAD );
+
+    frame = src.sealed.data() + src.sealed_pos;
+    if( !whole || !open_frame( *src.cipher, frame, src.plain.data() ) ) {
+        die("Unable to decrypt embedded data: wrong passphrase or the "
+                "image has been altered");
+    }
+    src.sealed_pos += n + FRAME_OVERHEAD;
+    src.plain_len   = n;
+    src.plain_pos   = 0;
+}
+
+/* take a run of up to n bytes of file data from the source. Returns the
+ * number of bytes taken, which is less than n only once there is no more */
+size_t
+source_read ( DataSource &src, BYTE *data, size_t n ) {
+    if( !src.cipher ) {
+        return retrieve_run( src, data, n );
+    }
+
+    size_t got = 0;
+    while( got < n ) {
+        if( src.plain_pos == src.plain_len ) {
+            if( src.last ) {
+                break;
+            }
+            open_next( src );
+            continue;
+        }
+
+        size_t take = std::min( n - got, src.plain_len - src.plain_pos );
+        memcpy( data + got, src.plain.data() + src.plain_pos, take );
+        src.plain_pos += take;
+        got += take;
+    }
+    return got;
+}
+
+/* retrieve the checksum which follows the file data, if the header calls for
+ * one, and make sure that nothing else was encrypted along with the file.
+ * Any data taken from the source but not used is passed in as extra. 
+ * Returns the checksum */
+uint32_t
+finish_source ( DataSource &src, const BYTE *extra, size_t n ) {
+    uint32_t stored = 0;
+
+    if( src.header->flags & FLAG_CHECKSUM ) {
+        BYTE trailer[CHECKSUM_BYTES];
+        size_t have = std::min( n, CHECKSUM_BYTES );
+
+        if( have ) {
+            memcpy( trailer, extra, have );
+            n -= have;
+        }
+        if( source_read( src, trailer + have, CHECKSUM_BYTES - have ) !=
+                CHECKSUM_BYTES - have ) {
+            die("Embedded data is corrupt");
+        }
+        stored = load_group( trailer, CHECKSUM_BYTES );
+    }
+
+    /* an empty last frame follows a file which fills its last frame */
+    if( src.cipher ) {
+        while( src.plain_pos == src.plain_len && !src.last ) {
+            open_next( src );
+        }
+        if( n || src.plain_pos != src.plain_len ) {
+            die("Embedded data is corrupt");
+        }
+    }
+    return stored;
+}
+
+/* retrieve the contents of a file compressed with deflate and write them to
+ * the output file. The compressed data is retrieved a buffer at a time and
+ * decompressed as it goes. It carries its own end marker, so retrieval
+ * carries on until that is found. The checksum of what was written is left
+ * in crc, and the one embedded after the data, if any, is returned */
+uint32_t
+retrieve_compressed( DataSource &src, const Header &header, int out,
+        const char *name, uint32_t &crc ) {
+    std::vector<BYTE> output( IO_BUFFER_SIZE );
+    std::vector<BYTE> &buffer = io_buffer();
+    size_t block = block_size( buffer, header );
+    LONG written = 0;
+    uint32_t stored = 0;
+    z_stream zs;
+
+    memset( &zs, 0, sizeof(zs) );
+    if( inflateInit( &zs ) != Z_OK ) {
+        die("Unable to decompress embedded data");
+    }
+
+    try {
+        for( int ret = Z_OK; ret != Z_STREAM_END; ) {
+            if( !zs.avail_in ) {
+                size_t n = source_read( src, buffer.data(), block );
+                if( !n ) {
+                    die("Embedded data is corrupt");
+                }
+                zs.next_in  = buffer.data();
+                zs.avail_in = n;
+            }
+
+            zs.next_out  = output.data();
+            zs.avail_out = output.size();
+            ret = inflate( &zs, Z_NO_FLUSH );
+            if( ret != Z_OK && ret != Z_STREAM_END ) {
+                die("Embedded data is corrupt");
+            }
+
+            size_t n = output.size() - zs.avail_out;
+            if( written + n > header.fsize ) {
+                die("Embedded data is corrupt");
+            }
+            crc = crc32c( crc, output.data(), n );
+            write_output( out, output.data(), n, name );
+            written += n;
+        }
+
+        if( written != header.fsize ) {
+            die("Embedded data is corrupt");
+        }
+
+        /* the checksum follows on from the end of the compressed data, and
+         * has most likely been retrieved along with it already */
+        stored = finish_source( src, zs.next_in, zs.avail_in );
+    } catch ( StegError &e ) {
+        inflateEnd( &zs );
+        throw;
+    }
+    inflateEnd( &zs );
+    return stored;
+}
+
+/* retrieve the contents of a file stored as they are and write them to the
+ * output file, a buffer at a time. When using several threads, each fills
+ * its own slice of the buffer before it is written out in one go. The
+ * checksum of what was written is left in crc, and the one embedded after
+ * the data, if any, is returned */
+uint32_t
+retrieve_plain( DataSource &src, const Header &header, int out,
+        const char *name, uint32_t &crc ) {
+    std::vector<BYTE> &buffer = io_buffer();
+    size_t block = block_size( buffer, header );
+
+    for( LONG remaining = header.fsize; remaining; ) {
+        size_t n = std::min( remaining, (LONG) block );
+        if( source_read( src, buffer.data(), n ) != n ) {
+            die("Embedded data is corrupt");
+        }
+        crc = crc32c( crc, buffer.data(), n );
+        write_output( out, buffer.data(), n, name );
+        remaining -= n;
+    }
+    return finish_source( src, NULL, 0 );
+}
+
+/* retrieve the file data which follows the header from the image and write it
+ * out, either to the named output file or to the filename in the header */
+void
+write_file( ChannelCursor &cur, const Header &header, 
+        const char *output_name ) {
+    const char *name = (output_name)? output_name : header.fname.c_str();
+    Cipher cipher;
+
+    /* a shard of a coded set may hold parity rather than part of the file */
+    if( header.scheme == SHARD_REED_SOLOMON && !g_shard ) {
+        die("Image holds a shard of a coded set, which can only be "
+                "retrieved alongside the rest with --shard");
+    }
+
+    Scatter scatter;
+    Cipher *opened = open_keys( cur, header, cipher, scatter );
+
+    /* open the target output file for writing. A shard's part goes into
+     * the file at its offset, alongside the parts from the other shards */
+    bool part = (header.flags & FLAG_SHARD) != 0;
+    int out = part? open_output_part( name, header.offset ) : 
+        create_output( name, header.fsize );
+    if( out < 0 ) {
+        /* handle case where we can't open the file for some reason */
+        close_cipher( cipher );
+        std::ostringstream oss;
+        oss << "Unable to open " << name << " for writing";
+        die(oss.str());
+    }
+
+    try {
+        DataSource src;
+        uint32_t crc = 0;
+        uint32_t stored;
+
+        init_source( src, cur, header, opened );
+        if( header.flags & FLAG_COMPRESSED ) {
+            stored = retrieve_compressed( src, header, out, name, crc );
+        } else {
+            stored = retrieve_plain( src, header, out, name, crc );
+        }
+
+        if( (header.flags & FLAG_CHECKSUM) && crc != stored ) {
+            die("Embedded file failed its checksum");
+        }
+    } catch ( StegError &e ) {
+        /* don't leave a damaged file behind. The other parts of a sharded
+         * file are left for whoever is putting it together to deal with */
+        cur.scatter = NULL;
+        close_cipher( cipher );
+        close_output( out );
+        if( !part ) {
+            std::remove( name );
+        }
+        throw;
+    }
+    cur.scatter = NULL;
+    close_cipher( cipher );
+
+    /* close the output file now that we are done */
+    if( !close_output( out ) ) {
+        std::ostringstream oss;
+        oss << "Unable to write to " << name;
+        die(oss.str());
+    }
+}
+
+void
+retrieve_file_from_image( cimg_library::CImg<CHANNEL> *img, 
+        const char *output_name = NULL ) {
+    
+    Header header;
+    ChannelCursor cur;
+
+    init_cursor( cur, img, INTERLEAVED, 0 );
+    retrieve_header( cur, header );
+    seek_data( cur, header );
+    write_file( cur, header, output_name );
+}
+
+/* retrieve a file from an image without loading the whole image into memory.
+ * Rows are decoded only as the data they hold is needed, and the image is
+ * closed as soon as the last byte of the file has been recovered. Returns
+ * false without writing anything if the image can't be handled this way, in
+ * which case the caller should fall back to loading it in full */
+bool
+retrieve_file_from_stream( const char *image_name, 
+        const char *output_name = NULL ) {
+    RowReader rows;
+    Header header;
+    ChannelCursor cur;
+
+    if( !open_rows( rows, image_name ) ) {
+        return false;
+    }
+
+    try {
+        init_cursor( cur, &rows );
+        retrieve_header( cur, header );
+
+        /* data embedded one plane at a time, or scattered, is spread 
+         * through the whole image */
+        if( header.flags & (FLAG_PLANAR | FLAG_SCATTER) ) {
+            close_rows( rows );
+            return false;
+        }
+
+        seek_data( cur, header );
+        write_file( cur, header, output_name );
+    } catch ( StegError &e ) {
+        close_rows( rows );
+        throw;
+    }
+
+    close_rows( rows );
+    return true;
+}
+
+/* retrieve a file from a binary PPM/PGM or PAM image mapped into memory. Only
+ * the pages holding the file are ever read. Returns false without writing
+ * anything if the image can't be handled this way */
+bool
+retrieve_file_from_raster( const char *image_name, 
+        const char *output_name = NULL ) {
+    Raster raster;
+    Header header;
+    ChannelCursor cur;
+
+    if( !open_raster( raster, image_name, false ) ) {
+        return false;
+    }
+
+    try {
+        init_cursor( cur, &raster );
+        retrieve_header( cur, header );
+
+        if( header.flags & FLAG_PLANAR ) {
+            close_raster( raster );
+            return false;
+        }
+
+        seek_data( cur, header );
+        write_file( cur, header, output_name );
+    } catch ( StegError &e ) {
+        close_raster( raster );
+        throw;
+    }
+
+    close_raster( raster );
+    return true;
+}
+
+/* retrieve a file from an uncompressed BMP image, reading only the rows that
+ * the file occupies. Returns false without writing anything if the image
+ * can't be handled this way */
+bool
+retrieve_file_from_patch( const char *image_name, 
+        const char *output_name = NULL ) {
+    PatchFile patch;
+    Header header;
+    ChannelCursor cur;
+
+    if( !open_patch( patch, image_name, false ) ) {
+        return false;
+    }
+
+    try {
+        init_cursor( cur, &patch );
+        retrieve_header( cur, header );
+
+        if( header.flags & (FLAG_PLANAR | FLAG_SCATTER) ) {
+            close_patch( patch );
+            return false;
+        }
+
+        seek_data( cur, header );
+        write_file( cur, header, output_name );
+    } catch ( StegError &e ) {
+        close_patch( patch );
+        throw;
+    }
+
+    close_patch( patch );
+    return true;
+}
+
+/* read a passphrase from the first line of a file */
+std::string
+read_passphrase( const char *filename ) {
+    std::ifstream in( filename );
+    std::string passphrase;
+
+    if( !in || !std::getline( in, passphrase ) ) {
+        std::ostringstream oss;
+        oss << "Unable to read a passphrase from " << filename;
+        die(oss.str());
+    }
+    if( !passphrase.empty() && passphrase[passphrase.length()-1] == '\r' ) {
+        passphrase.erase( passphrase.length()-1 );
+    }
+    if( passphrase.empty() ) {
+        std::ostringstream oss;
+        oss << filename << " holds an empty passphrase";
+        die(oss.str());
+    }
+    return passphrase;
+}
+
+/* handles input arguments from the command line. Extracts target file names,
+ * sets up the programs mode of operation and any global configuration options
+ * which the user has deigned to change */
+ArgMap
+handle_args ( int argc, char *argv[] ) {
+    ArgMap args;
+    for( int i=1; i<argc; i++ ) {
+        /* any argument which begins with a dash is presumed to be a flag. We
+         * parse the flag as appropriate */
+        if(argv[i][0] == '-') {
+            switch(argv[i][1]) {
+                case 'e':
+                    /* the e flag sets up the program to run in embed mode. It
+                     * also expects that the user has passed an input file to
+                     * be embedded. If no argument follows the -e flag then
+                     * the user has neglected to specify the file they wish
+                     * to embed and the program's operation terminates */
+                    if(i+1 >= argc) {
+                        std::ostringstream oss;
+                        oss << argv[i] << " expects an argument";
+                        die(oss.str());
+                    }
+                    
+                    i++;
+                    g_mode = EMBED;
+                    args[EMBED_FILE] = argv[i];
+                    break;
+                case 'o':
+                    /* the o flag specifies the name of the output file. If 
+                     * running in decode mode, then this will be the name of 
+                     * the file extracted from the image. If running in embed
+                     * mode then this will be the name of the output image
+                     * produced by the program. If no argument follows the -o
+                     * flag then the user has neglected to specify an output
+                     * file name and a warning will be issued. The program 
+                     * will then proceed to use default output names */
+                    if(i+1 >= argc) {
+                        std::ostringstream oss;
+                        oss << argv[i] << " expects an argument";
+                        warn(oss.str());
+                    } else {
+                        i++;
+                        args[OUTPUT_FILE] = argv[i];
+                    }             
+                    break;
+                case 'j':
+                    /* the j flag sets the number of threads used to embed
+                     * or retrieve the file. The whole image is held in 
+                     * memory so that each thread can work on a different 
+                     * part of it */
+                    if(i+1 >= argc || atoi(argv[i+1]) < 1) {
+                        std::ostringstream oss;
+                        oss << argv[i] << " expects a number of threads";
+                        die(oss.str());
+                    }
+
+                    i++;
+                    g_threads = atoi(argv[i]);
+                    break;
+                case 'b':
+                    /* the b flag sets how many of the low bits of each
+                     * channel are given over to the embedded file. More bits
+                     * fit a larger file in the image at the cost of a more
+                     * visible change. The choice is recorded in the header,
+                     * so images decode correctly without the flag */
+                    if(i+1 >= argc || atoi(argv[i+1]) < MIN_BITS_PER_CHANNEL
+                            || atoi(argv[i+1]) > MAX_BITS_PER_CHANNEL) {
+                        std::ostringstream oss;
+                        oss << argv[i] << " expects a number of bits from " 
+                            << MIN_BITS_PER_CHANNEL << " to " 
+                            << MAX_BITS_PER_CHANNEL;
+                        die(oss.str());
+                    }
+
+                    i++;
+                    g_bits = atoi(argv[i]);
+                    break;
+                case 'm':
+                    /* the m flag matrix encodes the file, hiding N bits in
+                     * the low bits of each block of 2^N-1 channels while
+                     * changing at most one of them. Far fewer channels are
+                     * changed than by storing the bits directly, at the cost
+                     * of a smaller capacity. The choice is recorded in the
+                     * header, so images decode correctly without the flag */
+                    if(i+1 >= argc || atoi(argv[i+1]) < MIN_MATRIX_BITS
+                            || atoi(argv[i+1]) > MAX_MATRIX_BITS) {
+                        std::ostringstream oss;
+                        oss << argv[i] << " expects a number of bits from " 
+                            << MIN_MATRIX_BITS << " to " 
+                            << MAX_MATRIX_BITS;
+                        die(oss.str());
+                    }
+
+                    i++;
+                    g_matrix = atoi(argv[i]);
+                    break;
+                case 'z':
+                    /* the z flag compresses the file with deflate before it
+                     * is embedded, which lets compressible files fit in a
+                     * smaller image and leaves fewer channels to embed. 
+                     * The file is decompressed again on retrieval */
+                    if(i+1 >= argc || atoi(argv[i+1]) < Z_BEST_SPEED ||
+                            atoi(argv[i+1]) > Z_BEST_COMPRESSION) {
+                        std::ostringstream oss;
+                        oss << argv[i] << " expects a compression level from "
+                            << Z_BEST_SPEED << " to " << Z_BEST_COMPRESSION;
+                        die(oss.str());
+                    }
+
+                    i++;
+                    g_level = atoi(argv[i]);
+                    break;
+                case 'c':
+                    /* the c flag embeds a CRC32C of the file along with it.
+                     * The file is checked against it when it is retrieved,
+                     * so an image which has been altered since is caught
+                     * rather than yielding a damaged file */
+                    g_checksum = true;
+                    break;
+                case 'k':
+                    /* the k flag encrypts the file before it is embedded,
+                     * or decrypts it on retrieval, using the passphrase on
+                     * the first line of the file which follows. Reading it
+                     * from a file keeps it off the command line, where any
+                     * other user could see it */
+                    if(i+1 >= argc) {
+                        std::ostringstream oss;
+                        oss << argv[i] << " expects an argument";
+                        die(oss.str());
+                    }
+
+                    i++;
+                    g_passphrase = read_passphrase( argv[i] );
+                    break;
+                case 'r':
+                    /* the r flag spreads the file over the whole image in
+                     * an order which only the passphrase given with -k can
+                     * reproduce, rather than packing it into the channels
+                     * at the start. Images embedded this way are marked as
+                     * such in their header */
+                    g_scatter = true;
+                    break;
+                case 'p':
+                    /* the p flag lays the embedded file out one colour plane
+                     * at a time rather than one pixel at a time. Images
+                     * embedded this way are marked as such in their header
+                     * so they will decode correctly without the flag */
+                    g_order = PLANAR;
+                    break;
+                case 's':
+                    /* the s flag sets up the program to run in subtract mode. 
+                     * It also expects that the user has passed an input file 
+                     * to be subtracted. If no argument follows the -s flag 
+                     * then the user has neglected to specify the file they 
+                     * wish to subtract and the program's operation 
+                     * terminates */
+                    if(i+1 >= argc) {
+                        std::ostringstream oss;
+                        oss << argv[i] << " expects an argument";
+                        die(oss.str());
+                    }
+                    
+                    i++;
+                    g_mode = SUBTRACT;
+                    args[SUBTRACT_FILE] = argv[i];
+                    break;
+                case '-':
+                    /* long flags. --batch runs every job listed in the
+                     * manifest which follows it, rather than working on a
+                     * single image */
+                    if( !strcmp( argv[i], "--batch" ) ) {
+                        if(i+1 >= argc) {
+                            std::ostringstream oss;
+                            oss << argv[i] << " expects an argument";
+                            die(oss.str());
+                        }
+
+                        i++;
+                        g_mode = BATCH;
+                        args[BATCH_FILE] = argv[i];
+                        break;
+                    }
+                    /* --info reads just the header of each image which
+                     * follows it and reports what is embedded there */
+                    if( !strcmp( argv[i], "--info" ) ) {
+                        g_mode = INFO;
+                        break;
+                    }
+                    /* --report describes the differences found by -s */
+                    if( !strcmp( argv[i], "--report" ) ) {
+                        g_report = true;
+                        break;
+                    }
+                    /* --shard splits the file being embedded across every
+                     * image given, or retrieves it from all of them */
+                    if( !strcmp( argv[i], "--shard" ) ) {
+                        g_shard = true;
+                        break;
+                    }
+                    /* --parity adds parity shards to those the file is
+                     * split into, so that it survives the loss of as many
+                     * of the images */
+                    if( !strcmp( argv[i], "--parity" ) ) {
+                        if(i+1 >= argc || atoi(argv[i+1]) < 1) {
+                            std::ostringstream oss;
+                            oss << argv[i] << " expects a number of shards";
+                            die(oss.str());
+                        }
+
+                        i++;
+                        g_parity = atoi(argv[i]);
+                        break;
+                    }
+                    /* fall through */
+                default:
+                    /* user tried to use a flag that the program does not
+                     * support. Issue a warning and proceed */
+                    std::ostringstream oss;
+                    oss << "Invalid flag: " << argv[i];
+                    warn(oss.str());
+            }            
+        } else {
+            /* any argument which does not begin with a dash (and is not an
+             * argument to some other existing flag)  must be an input file to 
+             * the program. At present this should really only be the input 
+             * image file, but in future there could be more */
+            ArgMap::iterator it = args.find(IMAGE);
+            if(it != args.end()) {
+                g_more_images.push_back( argv[i] );
+            } else {
+                args[IMAGE] = argv[i];
+            }
+        }
+    }
+
+    if( g_report && g_mode != SUBTRACT ) {
+        die("--report can only be used with -s");
+    }
+    if( g_parity && !(g_shard && g_mode == EMBED) ) {
+        die("--parity can only be used with --shard to embed a file");
+    }
+    if( g_shard ) {
+        if( g_mode == EMBED ) {
+            g_mode = SHARD_EMBED;
+        } else if( g_mode == DECODE ) {
+            g_mode = SHARD_DECODE;
+        } else {
+            die("--shard can only be used to embed or retrieve a file");
+        }
+    } else if( g_mode != INFO ) {
+        /* flags may follow the images, so which mode is running is only 
+         * known once they have all been read */
+        for( size_t j=0; j<g_more_images.size(); j++ ) {
+            std::ostringstream oss;
+            oss << "Already have input image. Ignoring " << g_more_images[j] 
+                << " and continuing with " << args[IMAGE];
+            warn(oss.str());
+        }
+        g_more_images.clear();
+    }
+    return args;
+}
+
+/* load an image from disk. When built with cimg_use_png, PNG images are
+ * decoded in-process by libpng rather than by spawning ImageMagick */
+void
+load_image( cimg_library::CImg<CHANNEL> &img, const char *image_name ) {
+    try {
+        img.load(image_name);
+    } catch ( cimg_library::CImgIOException &e ) {
+        std::ostringstream oss;
+        oss << "unable to open " << image_name;
+        die(oss.str());
+    }
+}
+
+/* write an image to disk, encoding PNG images in-process where possible */
+void
+save_image( const cimg_library::CImg<CHANNEL> &img, const char *output_name ) {
+    try {
+        img.save(output_name);
+    } catch ( cimg_library::CImgIOException &e ) {
+        std::ostringstream oss;
+        oss << "unable to write " << output_name;
+        die(oss.str());
+    }
+}
+
+/* embed an opened file under the given header in an image, and write the
+ * result to output_name. The image buffer is only used if the image can't
+ * be streamed, and may be reused from one job to the next */
+void
+embed_carrier( Payload &payload, const Header &header, 
+        const char *image_name, const char *output_name,
+        cimg_library::CImg<CHANNEL> &img ) {
+
+    /* where possible, embed straight into a mapped or patched copy of the
+     * image, or else pass the image through a row at a time rather than
+     * holding all of it in memory */
+    if( !embed_file_in_raster( payload, header, image_name, output_name ) &&
+            !embed_file_in_patch( payload, header, image_name, 
+                output_name ) &&
+            !embed_file_in_stream( payload, header, image_name, 
+                output_name ) ) {
+        load_image( img, image_name );
+
+        embed_file_in_image( payload, header, &img );
+
+        save_image( img, output_name );
+    }
+}
+
+/* embed a file in an image and write the result to output_name */
+void
+embed_job( const char *filename, const char *image_name, 
+        const char *output_name, cimg_library::CImg<CHANNEL> &img ) {
+    Payload payload;
+
+    if( !open_payload( payload, filename ) ) {
+        std::ostringstream oss;
+        oss << "unable to open " << filename;
+        die(oss.str());
+    }
+
+    try {
+        Header header = file_header( payload, filename );
+        embed_carrier( payload, header, image_name, output_name, img );
+    } catch ( StegError &e ) {
+        close_payload( payload );
+        throw;
+    }
+
+    close_payload( payload );
+}
+
+/* retrieve the file embedded in an image, writing it to output_name or to
+ * the name stored in the image if that is NULL */
+void
+decode_job( const char *image_name, const char *output_name, 
+        cimg_library::CImg<CHANNEL> &img ) {
+
+    /* where possible, decode only as much of the image as the embedded file
+     * occupies. When asked to use several threads, the whole image is held
+     * in memory instead so that each thread can work on a part of it, 
+     * unless it can be mapped or patched as it is */
+    if( retrieve_file_from_raster( image_name, output_name ) ||
+            retrieve_file_from_patch( image_name, output_name ) ) {
+        return;
+    }
+    if( g_threads == 1 && 
+            retrieve_file_from_stream( image_name, output_name ) ) {
+        return;
+    }
+
+    load_image( img, image_name );
+
+    retrieve_file_from_image( &img, output_name );
+}
+
+void
+run_embed_mode( ArgMap args ) {
+    char *image_name;
+    char *filename;
+    char *output_name;
+
+    ArgMap::iterator it = args.find(IMAGE);
+    if(it == args.end()) {
+        usage();
+    } 
+
+    image_name = it->second;
+
+    it = args.find(EMBED_FILE);
+    if(it == args.end()) {
+        usage();
+    } 
+
+    filename = it->second;
+
+    it = args.find(OUTPUT_FILE);
+    if(it == args.end()) {
+        output_name = const_cast<char*> (DEFAULT_OUTPUT);
+    } else {
+        output_name = it->second;
+    }
+
+    cimg_library::CImg<CHANNEL> img;
+    embed_job( filename, image_name, output_name, img );
+}
+
+void
+run_decode_mode( ArgMap args ) {
+    char *image_name;
+    char *output_name;
+
+    ArgMap::iterator it = args.find(IMAGE);
+    if(it == args.end()) {
+        usage();
+    } 
+
+    image_name = it->second;
+
+    it = args.find(OUTPUT_FILE);
+    if(it == args.end()) {
+        output_name = NULL;
+    } else {
+        output_name = it->second;
+    }
+
+    cimg_library::CImg<CHANNEL> img;
+    decode_job( image_name, output_name, img );
+}
+
+/* write a string out as a JSON string literal */
+void
+print_json_string( const std::string &str ) {
+    std::ostringstream oss;
+
+    oss << '"';
+    for( size_t i=0; i<str.length(); i++ ) {
+        unsigned char c = str[i];
+        if( c == '"' || c == '\\' ) {
+            oss << '\\' << c;
+        } else if( c < 0x20 || c == 0x7f ) {
+            char escape[8];
+            snprintf( escape, sizeof(escape), "\\u%04x", c );
+            oss << escape;
+        } else {
+            oss << c;
+        }
+    }
+    oss << '"';
+    std::cout << oss.str();
+}
+
+/* open an image to be read from in whatever way means reading the least of
+ * it: mapping it, patching it or streaming it where the format allows, and
+ * loading it in full only as a last resort. The cursor is left at the first
+ * channel of the image */
+void
+open_carrier( const char *image_name, Raster &raster, PatchFile &patch,
+        RowReader &rows, cimg_library::CImg<CHANNEL> &img, 
+        ChannelCursor &cur ) {
+    if( open_raster( raster, image_name, false ) ) {
+        init_cursor( cur, &raster );
+    } else if( open_patch( patch, image_name, false ) ) {
+        init_cursor( cur, &patch );
+    } else if( open_rows( rows, image_name ) ) {
+        init_cursor( cur, &rows );
+    } else {
+        load_image( img, image_name );
+        init_cursor( cur, &img, INTERLEAVED, 0 );
+    }
+}
+
+void
+close_carrier( Raster &raster, PatchFile &patch, RowReader &rows ) {
+    close_raster( raster );
+    close_patch( patch );
+    close_rows( rows );
+}
+
+/* read the header from the start of an image. Returns false if the image
+ * doesn't hold an embedded file */
+bool
+probe_image( const char *image_name, Header &header, LONG &capacity,
+        cimg_library::CImg<CHANNEL> &img ) {
+    Raster raster;
+    PatchFile patch;
+    RowReader rows;
+    ChannelCursor cur;
+    bool found = true;
+
+    open_carrier( image_name, raster, patch, rows, img, cur );
+
+    /* anything wrong with the header means there is nothing to find */
+    try {
+        retrieve_header( cur, header );
+        capacity = data_capacity( cur, header );
+    } catch ( StegError &e ) {
+        found = false;
+    }
+
+    close_carrier( raster, patch, rows );
+    return found;
+}
+
+/* print a line of JSON describing the file embedded in an image */
+void
+info_job( const char *image_name, cimg_library::CImg<CHANNEL> &img ) {
+    Header header;
+    LONG capacity;
+    bool found = probe_image( image_name, header, capacity, img );
+
+    std::cout << "{\"image\": ";
+    print_json_string( image_name );
+    std::cout << ", \"embedded\": " << (found? "true" : "false");
+    if( found ) {
+        std::cout << ", \"filename\": ";
+        print_json_string( header.fname );
+        std::cout << ", \"size\": " << header.fsize
+            << ", \"capacity\": " << capacity
+            << ", \"bits\": " 
+            << ((header.flags & FLAG_MATRIX)? 1 : (int) header.bits)
+            << ", \"planar\": " 
+            << ((header.flags & FLAG_PLANAR)? "true" : "false");
+        if( header.flags & FLAG_MATRIX ) {
+            std::cout << ", \"matrix\": " << (int) header.bits;
+        }
+        if( header.flags & FLAG_COMPRESSED ) {
+            std::cout << ", \"codec\": \"deflate\", \"level\": " 
+                << (int) header.level;
+        }
+        std::cout << ", \"checksum\": " 
+            << ((header.flags & FLAG_CHECKSUM)? "true" : "false");
+        if( header.flags & FLAG_ENCRYPTED ) {
+            std::cout << ", \"cipher\": \"chacha20-poly1305\"";
+        }
+        std::cout << ", \"scatter\": " 
+            << ((header.flags & FLAG_SCATTER)? "true" : "false");
+        if( header.flags & FLAG_SHARD ) {
+            std::ostringstream set;
+            set << std::hex << std::setw(16) << std::setfill('0') 
+                << header.set;
+            std::cout << ", \"set\": \"" << set.str() << "\""
+                << ", \"scheme\": \"" 
+                << ((header.scheme == SHARD_REED_SOLOMON)? "reed-solomon" : 
+                        "split") << "\""
+                << ", \"shard\": " << header.shard
+                << ", \"shards\": " << header.shards
+                << ", \"needed\": " << header.needed
+                << ", \"offset\": " << header.offset
+                << ", \"total\": " << header.total;
+        }
+    }
+    std::cout << "}" << std::endl;
+}
+
+/* every image named on the command line */
+std::vector<char *>
+image_list( ArgMap &args ) {
+    ArgMap::iterator it = args.find(IMAGE);
+    if(it == args.end()) {
+        usage();
+    } 
+
+    std::vector<char *> images( 1, it->second );
+    images.insert( images.end(), g_more_images.begin(), 
+            g_more_images.end() );
+    return images;
+}
+
+/* describe what is embedded in each of the images given, one line of JSON
+ * per image. An image which can't be read is reported in the same way, and
+ * the rest of the images are still looked at */
+void
+run_info_mode( ArgMap args ) {
+    std::vector<char *> images = image_list( args );
+
+    cimg_library::CImg<CHANNEL> img;
+    int failed = 0;
+    for( size_t i=0; i<images.size(); i++ ) {
+        try {
+            info_job( images[i], img );
+        } catch ( StegError &e ) {
+            failed++;
+            std::cout << "{\"image\": ";
+            print_json_string( images[i] );
+            std::cout << ", \"error\": ";
+            print_json_string( e.what() );
+            std::cout << "}" << std::endl;
+        }
+    }
+
+    if( failed ) {
+        std::ostringstream oss;
+        oss << failed << " images could not be read";
+        die(oss.str());
+    }
+}
+
+/* size of the largest part of a file which is sure to fit in an image that
+ * can hold capacity bytes under the given header */
+LONG
+shard_room( Header header, LONG capacity ) {
+    LONG lo = 0, hi = capacity;
+
+    while( lo < hi ) {
+        header.fsize = lo + (hi - lo + 1) / 2;
+        if( most_stream_bytes( header ) <= capacity ) {
+            lo = header.fsize;
+        } else {
+            hi = header.fsize - 1;
+        }
+    }
+    return lo;
+}
+
+/* number of bytes which can be embedded in an image under the given header */
+LONG
+carrier_capacity( const char *image_name, const Header &header,
+        cimg_library::CImg<CHANNEL> &img ) {
+    Raster raster;
+    PatchFile patch;
+    RowReader rows;
+    ChannelCursor cur;
+
+    open_carrier( image_name, raster, patch, rows, img, cur );
+    LONG capacity = data_capacity( cur, header );
+    close_carrier( raster, patch, rows );
+    return capacity;
+}
+
+/* report the shards which failed, and give up if there were any */
+void
+check_shards( const std::vector<char *> &images, 
+        const std::vector<std::string> &errors ) {
+    int failed = 0;
+
+    for( size_t i=0; i<errors.size(); i++ ) {
+        if( !errors[i].empty() ) {
+            failed++;
+            std::cout << "FAILED " << images[i] << ": " << errors[i] 
+                << std::endl;
+        }
+    }
+
+    if( failed ) {
+        std::ostringstream oss;
+        oss << failed << " shards failed";
+        die(oss.str());
+    }
+}
+
+/* coefficient by which part column is multiplied in parity shard row of a
+ * Reed-Solomon coded set. The parity shards are numbered after the parts, so
+ * that a row and a column never share a number and the matrix is a Cauchy
+ * matrix, every square block of which can be inverted. That is what lets
+ * any of the shards stand in for any missing part */
+BYTE
+coding_coefficient( LONG row, LONG column ) {
+    return gf_inv( row ^ column );
+}
+
+/* work out the shards of a Reed-Solomon coded set which aren't simply parts
+ * of the file: any parts from first on, which run past the end of the file
+ * and are padded out with zeros, and the parity shards. These are written
+ * one after another to the file coded, part bytes apiece. The set is worked
+ * on a stripe at a time, so only a chunk of each part is ever held in
+ * memory, and the worker threads take a stripe apiece */
+void
+encode_shards( const char *filename, const char *coded, 
+        const Header &header, LONG part, LONG first ) {
+    LONG needed = header.needed;
+    LONG chunks = (part + CODING_CHUNK - 1) / CODING_CHUNK;
+
+    int in  = open_input( filename );
+    int out = create_output( coded, (header.shards - first) * part );
+    if( in < 0 || out < 0 ) {
+        close_input( in );
+        if( out >= 0 ) {
+            close_output( out );
+        }
+        std::remove( coded );
+        std::ostringstream oss;
+        oss << "unable to open " << ((in < 0)? filename : coded);
+        die(oss.str());
+    }
+
+    try {
+        run_parallel( chunks, [&]( int c ) {
+            static thread_local std::vector<BYTE> stripe, parity;
+            LONG begin = (LONG) c * CODING_CHUNK;
+            size_t n = std::min( (LONG) CODING_CHUNK, part - begin );
+
+            stripe.resize( needed * CODING_CHUNK );
+            parity.resize( CODING_CHUNK );
+            for( LONG column=0; column<needed; column++ ) {
+                BYTE *data = &stripe[column * CODING_CHUNK];
+                LONG at = column * part + begin;
+                size_t have = (at < header.total)? 
+                    std::min( (LONG) n, header.total - at ) : 0;
+
+                if( !read_at( in, data, have, at ) ) {
+                    std::ostringstream oss;
+                    oss << "unable to read " << filename;
+                    die(oss.str());
+                }
+                memset( data + have, 0, n - have );
+                if( column >= first && 
+                        !write_at( out, data, n, (column - first) * part + 
+                            begin ) ) {
+                    die("Unable to write parity shards");
+                }
+            }
+
+            for( LONG row=needed; row<header.shards; row++ ) {
+                memset( parity.data(), 0, n );
+                for( LONG column=0; column<needed; column++ ) {
+                    gf_mul_add( parity.data(), &stripe[column * CODING_CHUNK],
+                            coding_coefficient( row, column ), n );
+                }
+                if( !write_at( out, parity.data(), n, 
+                            (row - first) * part + begin ) ) {
+                    die("Unable to write parity shards");
+                }
+            }
+        });
+    } catch ( StegError &e ) {
+        close_input( in );
+        close_output( out );
+        std::remove( coded );
+        throw;
+    }
+
+    close_input( in );
+    if( !close_output( out ) ) {
+        std::remove( coded );
+        die("Unable to write parity shards");
+    }
+}
+
+/* invert the n by n matrix m over GF(2^8) by Gauss-Jordan elimination,
+ * destroying m in the process. Returns false if it can't be inverted */
+bool
+invert_matrix( std::vector<BYTE> &m, std::vector<BYTE> &inverse, LONG n ) {
+    inverse.assign( n * n, 0 );
+    for( LONG i=0; i<n; i++ ) {
+        inverse[i*n + i] = 1;
+    }
+
+    for( LONG c=0; c<n; c++ ) {
+        LONG pivot = c;
+        while( pivot < n && !m[pivot*n + c] ) {
+            pivot++;
+        }
+        if( pivot == n ) {
+            return false;
+        }
+        if( pivot != c ) {
+            std::swap_ranges( &m[c*n], &m[c*n] + n, &m[pivot*n] );
+            std::swap_ranges( &inverse[c*n], &inverse[c*n] + n, 
+                    &inverse[pivot*n] );
+        }
+
+        BYTE scale = gf_inv( m[c*n + c] );
+        for( LONG j=0; j<n; j++ ) {
+            m[c*n + j]       = gf_mul( m[c*n + j], scale );
+            inverse[c*n + j] = gf_mul( inverse[c*n + j], scale );
+        }
+
+        /* subtraction is addition in GF(2^8) */
+        for( LONG r=0; r<n; r++ ) {
+            BYTE f = m[r*n + c];
+            if( r != c && f ) {
+                gf_mul_add( &m[r*n], &m[c*n], f, n );
+                gf_mul_add( &inverse[r*n], &inverse[c*n], f, n );
+            }
+        }
+    }
+    return true;
+}
+
+/* rebuild the parts missing from a Reed-Solomon coded set out of the shards
+ * listed in rows, one for every part. The shards are held in the file open
+ * on fd, each at its index times size, and the rebuilt parts are written
+ * back into their places among them */
+void
+rebuild_shards( int fd, const std::vector<LONG> &rows, LONG size ) {
+    LONG needed = rows.size();
+    std::vector<LONG> missing;
+
+    for( LONG c=0; c<needed; c++ ) {
+        if( std::find( rows.begin(), rows.end(), c ) == rows.end() ) {
+            missing.push_back( c );
+        }
+    }
+    if( missing.empty() ) {
+        return;
+    }
+
+    /* the shards retrieved are the parts times these rows of the coding
+     * matrix, so the parts are the shards times its inverse */
+    std::vector<BYTE> m( needed * needed ), inverse;
+    for( LONG r=0; r<needed; r++ ) {
+        for( LONG c=0; c<needed; c++ ) {
+            m[r*needed + c] = (rows[r] < needed)? (rows[r] == c) : 
+                coding_coefficient( rows[r], c );
+        }
+    }
+    if( !invert_matrix( m, inverse, needed ) ) {
+        die("Shards can't be decoded");
+    }
+
+    LONG chunks = (size + CODING_CHUNK - 1) / CODING_CHUNK;
+    run_parallel( chunks, [&]( int c ) {
+        static thread_local std::vector<BYTE> in, out;
+        LONG begin = (LONG) c * CODING_CHUNK;
+        size_t n = std::min( (LONG) CODING_CHUNK, size - begin );
+
+        in.resize( needed * CODING_CHUNK );
+        out.resize( CODING_CHUNK );
+        for( LONG r=0; r<needed; r++ ) {
+            if( !read_at( fd, &in[r * CODING_CHUNK], n, 
+                        rows[r] * size + begin ) ) {
+                die("Unable to read back the shards retrieved");
+            }
+        }
+        for( size_t d=0; d<missing.size(); d++ ) {
+            memset( out.data(), 0, n );
+            for( LONG r=0; r<needed; r++ ) {
+                gf_mul_add( out.data(), &in[r * CODING_CHUNK], 
+                        inverse[missing[d] * needed + r], n );
+            }
+            if( !write_at( fd, out.data(), n, missing[d] * size + begin ) ) {
+                die("Unable to write rebuilt shards");
+            }
+        }
+    });
+}
+
+/* share a file out between the images in proportion to the room in each,
+ * and then hand what rounding down left over to those with room to spare */
+void
+plan_split( const Header &header, const std::vector<LONG> &room, 
+        std::vector<LONG> &size, std::vector<LONG> &offset ) {
+    size_t count = room.size();
+    LONG all = 0;
+
+    for( size_t i=0; i<count; i++ ) {
+        all += room[i];
+    }
+    if( header.total > all ) {
+        std::ostringstream oss;
+        oss << "Images not large enough to embed data: they hold " << all
+            << " bytes between them";
+        die(oss.str());
+    }
+
+    LONG given = 0;
+    for( size_t i=0; i<count; i++ ) {
+        size[i] = std::min( room[i], (LONG) ((long double) header.total * 
+                    room[i] / std::max( all, (LONG) 1 )) );
+        given += size[i];
+    }
+    for( size_t i=0; i<count && given < header.total; i++ ) {
+        LONG more = std::min( room[i] - size[i], header.total - given );
+        size[i] += more;
+        given   += more;
+    }
+    offset[0] = 0;
+    for( size_t i=1; i<count; i++ ) {
+        offset[i] = offset[i-1] + size[i-1];
+    }
+}
+
+/* every shard of a coded set is the same size, as a parity shard is as big
+ * as the parts it covers. The image with the least room decides how big the
+ * parts can be */
+void
+plan_coded( const Header &header, const std::vector<LONG> &room, 
+        std::vector<LONG> &size, std::vector<LONG> &offset ) {
+    LONG part  = (header.total + header.needed - 1) / header.needed;
+    LONG least = *std::min_element( room.begin(), room.end() );
+
+    if( part > least ) {
+        std::ostringstream oss;
+        oss << "Images not large enough to embed data: with " 
+            << header.shards - header.needed << " parity shards they hold "
+            << least * header.needed << " bytes between them";
+        die(oss.str());
+    }
+    for( size_t i=0; i<room.size(); i++ ) {
+        size[i]   = part;
+        offset[i] = i * part;
+    }
+}
+
+/* split a file across every image given, embedding a shard of it in each and
+ * writing them to the output directory under the names of the images. Each
+ * image takes a part of the file in proportion to how much it can hold, so
+ * none of them is changed much more than the others. With --parity the last
+ * images hold parity shards instead, and the parts are all the same size.
+ * The images are worked on in parallel, each one by a single thread from
+ * start to finish */
+void
+run_shard_embed_mode( ArgMap args ) {
+    std::vector<char *> images = image_list( args );
+    size_t count = images.size();
+
+    ArgMap::iterator it = args.find(EMBED_FILE);
+    if(it == args.end()) {
+        usage();
+    } 
+    const char *filename = it->second;
+
+    it = args.find(OUTPUT_FILE);
+    boost::filesystem::path dir( (it == args.end())? DEFAULT_SHARD_DIR : 
+            it->second );
+
+    if( count > (g_parity? MAX_CODED_SHARDS : UINT32_MAX) ) {
+        die("Too many images to split a file across");
+    }
+    if( (size_t) g_parity >= count ) {
+        std::ostringstream oss;
+        oss << "No images are left to hold the file beside " << g_parity
+            << " parity shards";
+        die(oss.str());
+    }
+
+    /* every shard shares the one header, but for where its part goes */
+    Payload payload;
+    if( !open_payload( payload, filename ) ) {
+        std::ostringstream oss;
+        oss << "unable to open " << filename;
+        die(oss.str());
+    }
+    Header header = file_header( payload, filename );
+    close_payload( payload );
+
+    std::random_device random;
+    header.flags |= FLAG_SHARD;
+    header.scheme = g_parity? SHARD_REED_SOLOMON : SHARD_SPLIT;
+    header.set    = (LONG) random() << 32 | random();
+    header.shards = count;
+    header.needed = count - g_parity;
+    header.total  = header.fsize;
+    header.offset = 0;
+
+    std::vector<std::string> outputs( count );
+    for( size_t i=0; i<count; i++ ) {
+        outputs[i] = (dir / boost::filesystem::path( images[i] ).filename())
+            .string();
+        for( size_t j=0; j<i; j++ ) {
+            if( outputs[j] == outputs[i] ) {
+                std::ostringstream oss;
+                oss << images[j] << " and " << images[i] << 
+                    " would both be written to " << outputs[i];
+                die(oss.str());
+            }
+        }
+
+        /* a shard which failed would take the rest of the set, and with it
+         * the original images, down with it */
+        boost::system::error_code ec;
+        if( boost::filesystem::equivalent( images[i], outputs[i], ec ) ) {
+            std::ostringstream oss;
+            oss << images[i] << " would be overwritten by its own shard";
+            die(oss.str());
+        }
+    }
+
+    /* each image works on its own, so the worker threads take an image
+     * apiece rather than sharing the work on each one */
+    g_threads = 1;
+
+    std::vector<LONG> room( count );
+    run_parallel( count, [&]( int i ) {
+        cimg_library::CImg<CHANNEL> img;
+        room[i] = shard_room( header, 
+                carrier_capacity( images[i], header, img ) );
+    });
+
+    std::vector<LONG> size( count ), offset( count );
+    if( g_parity ) {
+        plan_coded( header, room, size, offset );
+    } else {
+        plan_split( header, room, size, offset );
+    }
+
+    boost::system::error_code ec;
+    boost::filesystem::create_directories( dir, ec );
+    if( ec ) {
+        std::ostringstream oss;
+        oss << "unable to create " << dir.string();
+        die(oss.str());
+    }
+
+    /* the parts of a coded set which lie wholly within the file are
+     * embedded straight from it. The rest, padded out with zeros, and the
+     * parity shards are worked out first into a file beside the shards */
+    std::string coded;
+    LONG first = count;
+    if( g_parity ) {
+        first = size[0]? std::min( header.needed, header.total / size[0] ) :
+            header.needed;
+        coded = (dir / boost::filesystem::unique_path( ".parity-%%%%%%%%" ))
+            .string();
+        encode_shards( filename, coded.c_str(), header, size[0], first );
+    }
+
+    /* only the files written by this run are cleared away if it fails */
+    std::vector<char> existed( count );
+    for( size_t i=0; i<count; i++ ) {
+        existed[i] = boost::filesystem::exists( outputs[i], ec );
+    }
+
+    std::vector<std::string> errors( count );
+    run_parallel( count, [&]( int i ) {
+        cimg_library::CImg<CHANNEL> img;
+        Payload part;
+        Header shard = header;
+
+        shard.shard  = i;
+        shard.offset = offset[i];
+        shard.fsize  = size[i];
+
+        try {
+            /* no two shards may share a key */
+            if( (shard.flags & KEYED_FLAGS) && !random_salt( shard.salt ) ) {
+                die("Unable to generate a salt");
+            }
+            bool opened = ((LONG) i < first)?
+                open_payload_part( part, filename, offset[i], size[i] ) :
+                open_payload_part( part, coded.c_str(), 
+                        (i - first) * size[i], size[i] );
+            if( !opened ) {
+                std::ostringstream oss;
+                oss << "unable to open " << 
+                    (((LONG) i < first)? filename : coded.c_str());
+                die(oss.str());
+            }
+            embed_carrier( part, shard, images[i], outputs[i].c_str(), img );
+        } catch ( StegError &e ) {
+            errors[i] = e.what();
+        }
+        close_payload( part );
+    });
+    if( g_parity ) {
+        std::remove( coded.c_str() );
+    }
+
+    /* a set of shards with one missing is no use to anyone */
+    for( size_t i=0; i<count; i++ ) {
+        if( !errors[i].empty() ) {
+            for( size_t j=0; j<count; j++ ) {
+                if( errors[j].empty() || !existed[j] ) {
+                    std::remove( outputs[j].c_str() );
+                }
+            }
+            break;
+        }
+    }
+    check_shards( images, errors );
+}
+
+/* put a file split into consecutive parts back together. Every part must be
+ * present, and they are retrieved in parallel, each into its place */
+void
+retrieve_split( const std::vector<char *> &images, 
+        const std::vector<Header> &headers, 
+        const std::map<LONG, size_t> &owner, const char *name ) {
+    const Header &set = headers[owner.begin()->second];
+
+    /* the parts have to cover the file exactly */
+    LONG end = 0;
+    for( LONG k=0; k<set.shards; k++ ) {
+        std::map<LONG, size_t>::const_iterator it = owner.find( k );
+        if( it == owner.end() ) {
+            std::ostringstream oss;
+            oss << "Shard " << k+1 << " of " << set.shards << " is missing";
+            die(oss.str());
+        }
+        if( headers[it->second].offset != end ) {
+            die("Shards do not fit together");
+        }
+        end += headers[it->second].fsize;
+    }
+    if( end != set.total ) {
+        die("Shards do not fit together");
+    }
+
+    int out = create_output( name, set.total );
+    if( out < 0 || !close_output( out ) ) {
+        std::ostringstream oss;
+        oss << "Unable to open " << name << " for writing";
+        die(oss.str());
+    }
+
+    std::vector<size_t> jobs;
+    for( std::map<LONG, size_t>::const_iterator it = owner.begin(); 
+            it != owner.end(); it++ ) {
+        jobs.push_back( it->second );
+    }
+
+    std::vector<std::string> errors( images.size() );
+    run_parallel( jobs.size(), [&]( int j ) {
+        cimg_library::CImg<CHANNEL> img;
+        try {
+            decode_job( images[jobs[j]], name, img );
+        } catch ( StegError &e ) {
+            errors[jobs[j]] = e.what();
+        }
+    });
+
+    for( size_t i=0; i<errors.size(); i++ ) {
+        if( !errors[i].empty() ) {
+            std::remove( name );
+            break;
+        }
+    }
+    check_shards( images, errors );
+}
+
+/* put a file back together from a Reed-Solomon coded set of shards. As many
+ * shards as there are parts are retrieved in parallel, parts first, each
+ * into its place in the output file. Should any of them fail, others are
+ * tried in their stead while there are enough left. The parts still missing
+ * are then rebuilt from the shards retrieved, and the parity cut off */
+void
+retrieve_coded( const std::vector<char *> &images, 
+        const std::vector<Header> &headers, 
+        const std::map<LONG, size_t> &owner, const char *name ) {
+    const Header &set = headers[owner.begin()->second];
+    std::map<LONG, size_t> untried = owner;
+    std::vector<LONG> rows;
+
+    int out = create_output( name, set.needed * set.fsize );
+    if( out < 0 || !close_output( out ) ) {
+        std::ostringstream oss;
+        oss << "Unable to open " << name << " for writing";
+        die(oss.str());
+    }
+
+    while( (LONG) rows.size() < set.needed ) {
+        if( (LONG) (rows.size() + untried.size()) < set.needed ) {
+            std::remove( name );
+            std::ostringstream oss;
+            oss << "Only " << rows.size() + untried.size() << " of " 
+                << set.shards << " shards could be read, and " << set.needed
+                << " are needed";
+            die(oss.str());
+        }
+
+        std::vector<size_t> jobs;
+        while( (LONG) (rows.size() + jobs.size()) < set.needed ) {
+            jobs.push_back( untried.begin()->second );
+            untried.erase( untried.begin() );
+        }
+
+        std::vector<std::string> errors( jobs.size() );
+        run_parallel( jobs.size(), [&]( int j ) {
+            cimg_library::CImg<CHANNEL> img;
+            try {
+                decode_job( images[jobs[j]], name, img );
+            } catch ( StegError &e ) {
+                errors[j] = e.what();
+            }
+        });
+
+        for( size_t j=0; j<jobs.size(); j++ ) {
+            if( errors[j].empty() ) {
+                rows.push_back( headers[jobs[j]].shard );
+            } else {
+                std::cout << "FAILED " << images[jobs[j]] << ": " 
+                    << errors[j] << std::endl;
+            }
+        }
+    }
+
+    int fd = open_update( name );
+    if( fd < 0 ) {
+        std::remove( name );
+        std::ostringstream oss;
+        oss << "Unable to open " << name << " for writing";
+        die(oss.str());
+    }
+    try {
+        rebuild_shards( fd, rows, set.fsize );
+        if( !truncate_output( fd, set.total ) ) {
+            die("Unable to write rebuilt shards");
+        }
+    } catch ( StegError &e ) {
+        close_output( fd );
+        std::remove( name );
+        throw;
+    }
+    if( !close_output( fd ) ) {
+        std::remove( name );
+        die("Unable to write rebuilt shards");
+    }
+}
+
+/* put a file split by run_shard_embed_mode() back together from its shards,
+ * which may be given in any order. An image which doesn't hold a shard is
+ * left out, in case parity can make up for it. Every other image has to
+ * hold a shard of the same file */
+void
+run_shard_decode_mode( ArgMap args ) {
+    std::vector<char *> images = image_list( args );
+    size_t count = images.size();
+
+    ArgMap::iterator it = args.find(OUTPUT_FILE);
+    const char *output_name = (it == args.end())? NULL : it->second;
+
+    g_threads = 1;
+
+    std::vector<Header> headers( count );
+    std::vector<char> found( count );
+    run_parallel( count, [&]( int i ) {
+        cimg_library::CImg<CHANNEL> img;
+        LONG capacity;
+        try {
+            found[i] = probe_image( images[i], headers[i], capacity, img ) &&
+                (headers[i].flags & FLAG_SHARD);
+        } catch ( StegError &e ) {
+            found[i] = false;
+        }
+    });
+
+    size_t first = count;
+    for( size_t i=0; i<count; i++ ) {
+        if( !found[i] ) {
+            std::ostringstream oss;
+            oss << images[i] << " does not hold a shard, and is left out";
+            warn(oss.str());
+        } else if( first == count ) {
+            first = i;
         }
     }
-}
+    if( first == count ) {
+        die("None of the images hold a shard");
+    }
 
-void
-embed_file_in_image( std::ifstream &file, std::string filename, 
-        cimg_library::CImg<CHANNEL> *img ) {
-    
-    int pix=0, channel=0;
-    
-    /* compute the size of the file */
-    std::streampos fsize = 0;
-    fsize = file.tellg();
-    file.seekg( 0, std::ios::end );
-    fsize = file.tellg() - fsize;
-    file.seekg(0, std::ios::beg);
+    const Header &set = headers[first];
+    std::map<LONG, size_t> owner;
+    for( size_t i=first; i<count; i++ ) {
+        const Header &header = headers[i];
+        std::ostringstream oss;
 
-    /* strip away any path information from our filename in a platform
-     * undependent way */
-    boost::filesystem::path p(filename);
-    filename = p.filename().string();
-
-    /* before we start writing data to the image, make sure it is large
-     * enough to store the embedded data. An image has a capacity that is 
-     * equal to its area times the number of channels per pixel times the
-     * number of bits we are storing per pixel. This yields a capacity in
-     * bits. We divide by the size of a byte (our smallest unit of storage)
-     * to get the capacity in bytes. This is compared to the size of the file
-     * plus the bits of metadata we include for pulling the data back out.
-     * If requirements exceed available resources then the program fails */
-    LONG embed_size = sizeof(BYTE) + filename.length() + sizeof(LONG) + fsize;
-    LONG image_capacity = 
-        (img->width() * img->height() * img->spectrum() * 
-         ENCODE_BITS_PER_CHANNEL)/(BYTES_TO_BITS(sizeof(BYTE)));
-
-    if( embed_size > image_capacity ) {
-        die("Image not large enough to embed data");
+        if( !found[i] ) {
+            continue;
+        }
+        if( header.set != set.set || header.scheme != set.scheme ||
+                header.shards != set.shards || 
+                header.needed != set.needed || header.total != set.total || 
+                header.fname != set.fname ) {
+            oss << images[i] << " holds a shard of a different file from " 
+                << images[first];
+            die(oss.str());
+        }
+        if( owner.count( header.shard ) ) {
+            oss << images[i] << " holds the same shard as " 
+                << images[owner[header.shard]];
+            die(oss.str());
+        }
+        owner[header.shard] = i;
     }
 
-    /* embed the filename and the filename length in the image */
-    embed( img, filename.length(), sizeof(BYTE), pix, channel );
-    for( LONG i=0; i<filename.length(); i++ ) {
-        embed( img, filename[i], sizeof(CHAR), pix, channel );
+    const char *name = (output_name)? output_name : set.fname.c_str();
+    if( set.scheme == SHARD_REED_SOLOMON ) {
+        retrieve_coded( images, headers, owner, name );
+    } else {
+        retrieve_split( images, headers, owner, name );
     }
+}
 
-    /* embed file size in the image */
-    embed( img, fsize, sizeof(LONG), pix, channel );
+/* what subtracting one image from another found. Every statistic reported
+ * follows from how often each difference turns up in each channel: the
+ * least significant bit of a channel changed exactly when its difference is
+ * odd. The bounding box takes in every pixel in which any channel differs,
+ * and is empty while right < left */
+struct DiffStats {
+    int width;
+    int height;
+    int spectrum;
+    std::vector<LONG> histogram; /* per channel, 256 counts apiece */
+    int left, top, right, bottom;
+};
 
-    /* embed file data in the image */
-    BYTE byte;
-    while( !file.eof() ) {
-        byte = file.get();
-        embed( img, byte, sizeof(BYTE), pix, channel );
-    } 
+void
+init_stats( DiffStats &stats, int width, int height, int spectrum ) {
+    stats.width    = width;
+    stats.height   = height;
+    stats.spectrum = spectrum;
+    stats.histogram.assign( (size_t) spectrum * 256, 0 );
+    stats.left     = width;
+    stats.top      = height;
+    stats.right    = -1;
+    stats.bottom   = -1;
 }
 
+/* count the differences between a row of one image and the same row of
+ * another. The row holds n channels, with the given number of channels to a
+ * pixel, the first of which is channel first of the image */
 void
-retrieve_file_from_image( cimg_library::CImg<CHANNEL> *img, 
-        char *output_name = NULL ) {
-    int pix=0, channel=0;
-    
-    std::ofstream out;
-    uint64_t fsize;
-    uint8_t  fname_len;
-    std::string fname;
+tally_row( DiffStats &stats, const CHANNEL *a, const CHANNEL *b, size_t n,
+        int y, int channels, int first ) {
+    LONG *histogram = stats.histogram.data() + (size_t) first * 256;
 
-    /* retrieve information about the file we are about to load - file size
-     * file name and the length of the file name */
-    fname_len = retrieve( img, sizeof(BYTE), pix, channel );
-    for( int i=0; i<fname_len; i++ ) {
-        char c = retrieve( img, sizeof(CHAR), pix, channel );
-        fname += c;
+    for( size_t i=0; i<n; ) {
+        for( int s=0; s<channels && i<n; s++, i++ ) {
+            int d = (a[i] > b[i])? a[i] - b[i] : b[i] - a[i];
+            histogram[s*256 + d]++;
+        }
     }
-    fsize = retrieve( img, sizeof(LONG), pix, channel );
 
-    /* open the target output file for writing */
-    out.open((output_name)? output_name : fname.c_str(), std::ios::binary);
-    if(!out.is_open()) {
-        /* handle case where we can't open the file for some reason */
-        std::cout << "Unable to open " << fname << " for writing" << std::endl;
+    /* rows which are the same throughout are by far the most common, and
+     * are passed over by the first search */
+    size_t left = std::mismatch( a, a + n, b ).first - a;
+    if( left == n ) {
         return;
     }
-
-    /* start retrieving file data from the image and writing to the output
-     * stream */
-    for( LONG i=0; i<fsize; i++ ) {
-        BYTE byte = retrieve( img, sizeof(BYTE), pix, channel );
-        out << byte;
+    size_t right = n - 1;
+    while( a[right] == b[right] ) {
+        right--;
     }
 
-    /* close the output stream now that we are done */
-    out.close();
+    stats.left   = std::min( stats.left, (int) (left / channels) );
+    stats.right  = std::max( stats.right, (int) (right / channels) );
+    stats.top    = std::min( stats.top, y );
+    stats.bottom = std::max( stats.bottom, y );
 }
 
-/* handles input arguments from the command line. Extracts target file names,
- * sets up the programs mode of operation and any global configuration options
- * which the user has deigned to change */
-ArgMap
-handle_args ( int argc, char *argv[] ) {
-    ArgMap args;
-    for( int i=1; i<argc; i++ ) {
-        /* any argument which begins with a dash is presumed to be a flag. We
-         * parse the flag as appropriate */
-        if(argv[i][0] == '-') {
-            switch(argv[i][1]) {
-                case 'e':
-                    /* the e flag sets up the program to run in embed mode. It
-                     * also expects that the user has passed an input file to
-                     * be embedded. If no argument follows the -e flag then
-                     * the user has neglected to specify the file they wish
-                     * to embed and the program's operation terminates */
-                    if(i+1 >= argc) {
-                        std::ostringstream oss;
-                        oss << argv[i] << " expects an argument";
-                        die(oss.str());
-                    }
-                    
-                    i++;
-                    g_mode = EMBED;
-                    args[EMBED_FILE] = argv[i];
-                    break;
-                case 'o':
-                    /* the o flag specifies the name of the output file. If 
-                     * running in decode mode, then this will be the name of 
-                     * the file extracted from the image. If running in embed
-                     * mode then this will be the name of the output image
-                     * produced by the program. If no argument follows the -o
-                     * flag then the user has neglected to specify an output
-                     * file name and a warning will be issued. The program 
-                     * will then proceed to use default output names */
-                    if(i+1 >= argc) {
-                        std::ostringstream oss;
-                        oss << argv[i] << " expects an argument";
-                        warn(oss.str());
-                    } else {
-                        i++;
-                        args[OUTPUT_FILE] = argv[i];
-                    }             
-                    break;
-                case 's':
-                    /* the s flag sets up the program to run in subtract mode. 
-                     * It also expects that the user has passed an input file 
-                     * to be subtracted. If no argument follows the -s flag 
-                     * then the user has neglected to specify the file they 
-                     * wish to subtract and the program's operation 
-                     * terminates */
-                    if(i+1 >= argc) {
-                        std::ostringstream oss;
-                        oss << argv[i] << " expects an argument";
-                        die(oss.str());
-                    }
-                    
-                    i++;
-                    g_mode = SUBTRACT;
-                    args[SUBTRACT_FILE] = argv[i];
-                    break;
-                default:
-                    /* user tried to use a flag that the program does not
-                     * support. Issue a warning and proceed */
-                    std::ostringstream oss;
-                    oss << "Invalid flag: " << argv[i];
-                    warn(oss.str());
-            }            
-        } else {
-            /* any argument which does not begin with a dash (and is not an
-             * argument to some other existing flag)  must be an input file to 
-             * the program. At present this should really only be the input 
-             * image file, but in future there could be more */
-            ArgMap::iterator it = args.find(IMAGE);
-            if(it != args.end()) {
-                std::ostringstream oss;
-                oss << "Already have input image. Ignoring " << argv[i] << 
-                    " and continuing with " << it->second;
-                warn(oss.str());
-            } else {
-                args[IMAGE] = argv[i];
+/* add the differences counted in more to those counted in stats, which are
+ * of the same images */
+void
+merge_stats( DiffStats &stats, const DiffStats &more ) {
+    for( size_t i=0; i<stats.histogram.size(); i++ ) {
+        stats.histogram[i] += more.histogram[i];
+    }
+    stats.left   = std::min( stats.left, more.left );
+    stats.top    = std::min( stats.top, more.top );
+    stats.right  = std::max( stats.right, more.right );
+    stats.bottom = std::max( stats.bottom, more.bottom );
+}
+
+/* count the differences between two images held in memory, a row of each
+ * plane at a time */
+void
+tally_images( DiffStats &stats, cimg_library::CImg<CHANNEL> &img, 
+        cimg_library::CImg<CHANNEL> &sub ) {
+    for( int s=0; s<img.spectrum(); s++ ) {
+        for( int z=0; z<img.depth(); z++ ) {
+            for( int y=0; y<img.height(); y++ ) {
+                tally_row( stats, img.data( 0, y, z, s ), 
+                        sub.data( 0, y, z, s ), img.width(), y, 1, s );
             }
         }
     }
-    return args;
 }
 
-
+/* print what subtracting sub_name from image_name found as a line of JSON */
 void
-run_embed_mode( ArgMap args ) {
-    char *image_name;
-    char *filename;
-    char *output_name;
-
-    ArgMap::iterator it = args.find(IMAGE);
-    if(it == args.end()) {
-        usage();
-    } 
+print_stats( const DiffStats &stats, const char *image_name, 
+        const char *sub_name ) {
+    std::vector<LONG> histogram( 256, 0 );
+    LONG changed = 0, channels = 0;
+    long double squares = 0;
 
-    image_name = it->second;
+    std::cout << "{\"image\": ";
+    print_json_string( image_name );
+    std::cout << ", \"subtract\": ";
+    print_json_string( sub_name );
+    std::cout << ", \"width\": " << stats.width << ", \"height\": " 
+        << stats.height << ", \"channels\": [";
 
-    it = args.find(EMBED_FILE);
-    if(it == args.end()) {
-        usage();
-    } 
+    for( int s=0; s<stats.spectrum; s++ ) {
+        const LONG *counts = stats.histogram.data() + (size_t) s * 256;
+        LONG differ = 0, lsbs = 0;
 
-    filename = it->second;
+        for( int d=0; d<256; d++ ) {
+            histogram[d] += counts[d];
+            channels     += counts[d];
+            squares      += (long double) counts[d] * d * d;
+            if( d ) {
+                differ += counts[d];
+            }
+            if( d & 1 ) {
+                lsbs += counts[d];
+            }
+        }
+        changed += differ;
+        std::cout << ((s)? ", " : "") << "{\"changed\": " << differ 
+            << ", \"lsb\": " << lsbs << "}";
+    }
 
-    it = args.find(OUTPUT_FILE);
-    if(it == args.end()) {
-        output_name = const_cast<char*> (DEFAULT_OUTPUT);
+    std::cout << "], \"changed\": " << changed << ", \"bounds\": ";
+    if( stats.right < stats.left ) {
+        std::cout << "null";
     } else {
-        output_name = it->second;
+        std::cout << "{\"x\": " << stats.left << ", \"y\": " << stats.top 
+            << ", \"width\": " << stats.right - stats.left + 1 
+            << ", \"height\": " << stats.bottom - stats.top + 1 << "}";
     }
 
-    std::ifstream in;
-    cimg_library::CImg<CHANNEL> img;
+    std::cout << ", \"histogram\": [";
+    for( int d=0; d<256; d++ ) {
+        std::cout << ((d)? ", " : "") << histogram[d];
+    }
 
-    in.open(filename, std::ios::binary);
-    if(!in.is_open()) {
-        std::ostringstream oss;
-        oss << "unable to open " << filename;
-        die(oss.str());
+    /* identical images have no finite peak signal to noise ratio */
+    const double peak = (CHANNEL) ~0;
+    double mse = (channels)? (double) (squares / channels) : 0;
+    std::cout << "], \"mse\": " << mse << ", \"psnr\": ";
+    if( mse > 0 ) {
+        std::cout << 10 * log10( peak * peak / mse );
+    } else {
+        std::cout << "null";
     }
+    std::cout << "}" << std::endl;
+}
 
-    try {
-        img.load(image_name);
-    } catch ( cimg_library::CImgIOException e ) {
+/* brightest channel of an image which can be read row by row. Reading stops
+ * as soon as a channel at the brightest possible value turns up */
+unsigned int
+stream_max( const char *image_name ) {
+    RowReader rows;
+    unsigned int max = 0;
+
+    if( !open_rows( rows, image_name ) ) {
         std::ostringstream oss;
         oss << "unable to open " << image_name;
         die(oss.str());
     }
 
-    embed_file_in_image( in, filename, &img);
-
-    img.save(output_name);
+    std::vector<CHANNEL> row( (size_t) rows.width * rows.spectrum );
+    for( int y=0; y<rows.height && max < (CHANNEL) ~0; y++ ) {
+        if( !read_row( rows, row.data() ) ) {
+            close_rows( rows );
+            std::ostringstream oss;
+            oss << "unable to read " << image_name;
+            die(oss.str());
+        }
+        for( size_t i=0; i<row.size(); i++ ) {
+            max = std::max( max, (unsigned int) row[i] );
+        }
+    }
 
-    in.close();
+    close_rows( rows );
+    return max;
 }
 
+/* read the next n rows of an image into a band */
 void
-run_decode_mode( ArgMap args ) {
-    char *image_name;
-    char *output_name;
+read_band( RowReader &rows, CHANNEL *band, int n, const char *image_name ) {
+    size_t row = (size_t) rows.width * rows.spectrum;
 
-    ArgMap::iterator it = args.find(IMAGE);
-    if(it == args.end()) {
-        usage();
-    } 
+    for( int y=0; y<n; y++ ) {
+        if( !read_row( rows, band + y * row ) ) {
+            std::ostringstream oss;
+            oss << "unable to read " << image_name;
+            die(oss.str());
+        }
+    }
+}
 
-    image_name = it->second;
+/* subtract one image from another as both are read a band of rows at a
+ * time, writing out each band of the result as soon as it is ready, so
+ * that only a few bands are ever held in memory however large the images.
+ * While the next band of each image is read, the band before is subtracted
+ * by every worker thread, a slice of its rows apiece, and the band before
+ * that is written out. If stats is given the differences are counted in
+ * the same pass, and if output_name is NULL no image is written at all.
+ * Returns false without writing anything if the images can't be streamed,
+ * in which case they should be loaded in full instead */
+bool
+subtract_in_stream( const char *image_name, const char *subtract_name,
+        const char *output_name, DiffStats *stats ) {
+    RowReader a, b;
+    RowWriter out;
 
-    it = args.find(OUTPUT_FILE);
-    if(it == args.end()) {
-        output_name = NULL;
-    } else {
-        output_name = it->second;
+    /* the output can't be written over an image still being read */
+    boost::system::error_code ec;
+    if( output_name && 
+            (boost::filesystem::equivalent( image_name, output_name, ec ) ||
+             boost::filesystem::equivalent( subtract_name, output_name, 
+                 ec )) ) {
+        return false;
     }
 
-    cimg_library::CImg<CHANNEL> img;
+    if( !open_rows( a, image_name ) ) {
+        return false;
+    }
+    if( !open_rows( b, subtract_name ) ) {
+        close_rows( a );
+        return false;
+    }
+
+    bool created = false;
     try {
-        img.load(image_name);
-    } catch ( cimg_library::CImgIOException e ) {
+        if( a.width != b.width || a.height != b.height || 
+                a.spectrum != b.spectrum ) {
+            die("Subtraction requires two images of the same size");
+        }
+
+        /* the differences are scaled up to the brightest channel of the
+         * first image, which has to be known before the first band is
+         * written. Finding it takes a pass over the image of its own, but
+         * one which stops at the first channel at full brightness, and so
+         * is over within a few rows for most images */
+        CHANNEL table[16];
+        if( output_name ) {
+            unsigned int max = stream_max( image_name );
+            for( unsigned int d=0; d<16; d++ ) {
+                table[d] = std::min( d, (unsigned int) CHANNEL_BIT_MASK ) * 
+                    max / CHANNEL_BIT_MASK;
+            }
+
+            created = create_rows( out, output_name, a.width, a.height, 
+                    a.spectrum );
+            if( !created ) {
+                close_rows( a );
+                close_rows( b );
+                return false;
+            }
+        }
+        size_t row = (size_t) a.width * a.spectrum;
+        int band = std::max( (size_t) 1, SUBTRACT_BAND / std::max( row, 
+                    (size_t) 1 ) );
+        int bands = (a.height + band - 1) / band;
+        auto rows_in = [&]( int k ) {
+            return (k >= 0 && k < bands)? std::min( band, a.height - k * band )
+                : 0;
+        };
+
+        /* each slice of the bands has its differences counted apart, and
+         * the counts are added up at the end */
+        int slices = worker_count();
+        std::vector<DiffStats> tallies( stats? slices : 0 );
+        for( size_t s=0; s<tallies.size(); s++ ) {
+            init_stats( tallies[s], a.width, a.height, a.spectrum );
+        }
+
+        /* the bands being read, subtracted and written take turns in each
+         * pair of buffers */
+        std::vector<CHANNEL> in_a[2], in_b[2], diff[2];
+        for( int k=0; k<2; k++ ) {
+            in_a[k].resize( band * row );
+            in_b[k].resize( band * row );
+            if( output_name ) {
+                diff[k].resize( band * row );
+            }
+        }
+
+        for( int k=0; k<bands+2; k++ ) {
+            run_parallel( 3 + slices, [&]( int task ) {
+                if( task == 0 ) {
+                    read_band( a, in_a[k & 1].data(), rows_in( k ), 
+                            image_name );
+                } else if( task == 1 ) {
+                    read_band( b, in_b[k & 1].data(), rows_in( k ), 
+                            subtract_name );
+                } else if( task == 2 ) {
+                    const CHANNEL *done = diff[k & 1].data();
+                    for( int y=0; output_name && y<rows_in( k - 2 ); y++ ) {
+                        if( !write_row( out, done + y * row ) ) {
+                            std::ostringstream oss;
+                            oss << "unable to write " << output_name;
+                            die(oss.str());
+                        }
+                    }
+                } else {
+                    const int s = task - 3, last = (k - 1) & 1;
+                    const int rows = rows_in( k - 1 );
+                    size_t begin = (size_t) rows * s / slices * row;
+                    size_t end   = (size_t) rows * (s + 1) / slices * row;
+
+                    const CHANNEL *from = in_a[last].data();
+                    const CHANNEL *sub  = in_b[last].data();
+
+                    for( size_t i=begin; stats && i<end; i+=row ) {
+                        tally_row( tallies[s], from + i, sub + i, row, 
+                                (k - 1) * band + i / row, a.spectrum, 0 );
+                    }
+                    if( output_name ) {
+                        diff_channels( diff[last].data() + begin, 
+                                from + begin, sub + begin, table, 
+                                end - begin );
+                    }
+                }
+            });
+        }
+
+        if( stats ) {
+            init_stats( *stats, a.width, a.height, a.spectrum );
+            for( size_t s=0; s<tallies.size(); s++ ) {
+                merge_stats( *stats, tallies[s] );
+            }
+        }
+    } catch ( StegError &e ) {
+        /* don't leave a partly written image behind */
+        close_rows( a );
+        close_rows( b );
+        close_rows( out );
+        if( created ) {
+            std::remove( output_name );
+        }
+        throw;
+    }
+
+    close_rows( a );
+    close_rows( b );
+    if( output_name && !close_rows( out ) ) {
         std::ostringstream oss;
-        oss << "unable to open " << image_name;
+        oss << "unable to write " << output_name;
         die(oss.str());
     }
-
-    retrieve_file_from_image( &img, output_name );
+    return true;
 }
 
+/* subtract one image from another, writing out an image of the differences
+ * and, with --report, describing them as JSON. When reporting, the image is
+ * only written if -o names it */
 void
 run_subtract_mode( ArgMap args ) {
     char *image_name;
@@ -426,57 +4403,167 @@ run_subtract_mode( ArgMap args ) {
 
     it = args.find(OUTPUT_FILE);
     if(it == args.end()) {
-        output_name = const_cast<char*> (DEFAULT_OUTPUT);
+        output_name = g_report? NULL : const_cast<char*> (DEFAULT_OUTPUT);
     } else {
         output_name = it->second;
     }
 
-    cimg_library::CImg<CHANNEL> img;
-    try {
-        img.load(image_name);
-    } catch ( cimg_library::CImgIOException e ) {
-        std::ostringstream oss;
-        oss << "unable to open " << image_name;
-        die(oss.str());
+    DiffStats stats;
+    DiffStats *counting = g_report? &stats : NULL;
+
+    /* where possible, subtract the images a band of rows at a time rather
+     * than holding both of them and the result in memory */
+    if( subtract_in_stream( image_name, subtract_name, output_name, 
+                counting ) ) {
+        if( counting ) {
+            print_stats( stats, image_name, subtract_name );
+        }
+        return;
     }
 
+    cimg_library::CImg<CHANNEL> img;
+    load_image( img, image_name );
+
     cimg_library::CImg<CHANNEL> sub;
-    try {
-        sub.load(subtract_name);
-    } catch ( cimg_library::CImgIOException e ) {
-        std::ostringstream oss;
-        oss << "unable to open " << subtract_name;
-        die(oss.str());
-    }
+    load_image( sub, subtract_name );
 
     if( img.width() != sub.width() || img.height() != sub.height() || 
             img.spectrum() != sub.spectrum() || img.depth() != sub.depth() ) {
         die("Subtraction requires two images of the same size");
     }
 
-    cimg_library::CImg<CHANNEL> result( img.width(), img.height(), img.depth(), 
-            img.spectrum(), 0);
+    if( counting ) {
+        init_stats( stats, img.width(), img.height(), img.spectrum() );
+        tally_images( stats, img, sub );
+    }
+
+    if( output_name ) {
+        cimg_library::CImg<CHANNEL> result( img.width(), img.height(), 
+                img.depth(), img.spectrum(), 0);
+
+        subtract_images( img, sub, result );
+
+        save_image( result, output_name );
+    }
+
+    if( counting ) {
+        print_stats( stats, image_name, subtract_name );
+    }
+}
+
+/* run every job listed in a manifest within this one process. Each line of
+ * the manifest holds up to three tab separated fields: the file to embed, the
+ * image and the output. A job whose first field is empty or "-" retrieves
+ * the file from the image instead of embedding one, and the output may be
+ * left out to use the default. Blank lines and lines beginning with # are
+ * ignored. A failed job is reported and the batch moves on to the next */
+void
+run_batch_mode( ArgMap args ) {
+    ArgMap::iterator it = args.find(BATCH_FILE);
+    if(it == args.end()) {
+        usage();
+    } 
+
+    std::ifstream manifest( it->second );
+    if(!manifest.is_open()) {
+        std::ostringstream oss;
+        oss << "unable to open " << it->second;
+        die(oss.str());
+    }
+
+    /* one image buffer serves every job, so that a run of images of the
+     * same size doesn't reallocate it each time */
+    cimg_library::CImg<CHANNEL> img;
+
+    std::string line;
+    int line_number = 0, jobs = 0, failed = 0;
+    while( std::getline( manifest, line ) ) {
+        line_number++;
+        if( !line.empty() && line[line.length()-1] == '\r' ) {
+            line.erase( line.length()-1 );
+        }
+        if( line.empty() || line[0] == '#' ) {
+            continue;
+        }
+
+        std::vector<std::string> fields;
+        std::istringstream iss( line );
+        for( std::string field; std::getline( iss, field, '\t' ); ) {
+            fields.push_back( field );
+        }
+        fields.resize( 3 );
+
+        const std::string &payload = fields[0];
+        const std::string &image   = fields[1];
+        const std::string &output  = fields[2];
+        bool decode = payload.empty() || payload == "-";
 
-    subtract_images( img, sub, result );
+        jobs++;
+        try {
+            if( image.empty() ) {
+                die("No image given");
+            }
+
+            if( decode ) {
+                decode_job( image.c_str(), 
+                        output.empty()? NULL : output.c_str(), img );
+            } else {
+                embed_job( payload.c_str(), image.c_str(), 
+                        output.empty()? DEFAULT_OUTPUT : output.c_str(), img );
+            }
+            std::cout << "OK " << line_number << " " << image << std::endl;
+        } catch ( StegError &e ) {
+            failed++;
+            std::cout << "FAILED " << line_number << " " << image << ": " 
+                << e.what() << std::endl;
+        }
+    }
 
-    result.save(output_name);
+    std::cout << jobs - failed << " of " << jobs << " jobs succeeded" 
+        << std::endl;
+
+    if( failed ) {
+        std::ostringstream oss;
+        oss << failed << " jobs failed";
+        die(oss.str());
+    }
 }
 
 int
 main ( int argc, char *argv[] )
 {
-    ArgMap args = handle_args( argc, argv );
+    try {
+        ArgMap args = handle_args( argc, argv );
 
-    switch(g_mode) {
-        case EMBED:
-            run_embed_mode(args);
-            break;
-        case DECODE:
-            run_decode_mode(args); 
-            break;
-        case SUBTRACT:
-            run_subtract_mode(args);
-            break;
+        init_kernels();
+        start_workers( g_threads );
+
+        switch(g_mode) {
+            case EMBED:
+                run_embed_mode(args);
+                break;
+            case DECODE:
+                run_decode_mode(args); 
+                break;
+            case SUBTRACT:
+                run_subtract_mode(args);
+                break;
+            case BATCH:
+                run_batch_mode(args);
+                break;
+            case INFO:
+                run_info_mode(args);
+                break;
+            case SHARD_EMBED:
+                run_shard_embed_mode(args);
+                break;
+            case SHARD_DECODE:
+                run_shard_decode_mode(args);
+                break;
+        }
+    } catch ( StegError &e ) {
+        std::cout << "ERROR: " << e.what() << std::endl;
+        exit(-1);
     }
 
     return EXIT_SUCCESS;
@@ -0,0 +1,186 @@
+#include "patch.h"
+#include <cstring>
+#include <vector>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+/* a BMP file begins with a file header, followed by an info header of at
+ * least 40 bytes which describes the image */
+#define BMP_FILE_HEADER_SIZE 14
+#define BMP_HEADER_SIZE      54
+
+/* the little endian integer of the given size at the start of a buffer */
+static uint32_t
+read_le ( const BYTE *p, int bytes ) {
+    uint32_t v = 0;
+    for( int i=bytes-1; i>=0; i-- ) {
+        v = (v << BYTES_TO_BITS(1)) | p[i];
+    }
+    return v;
+}
+
+/* read or write a whole buffer at a position in a file */
+static bool
+pread_fully ( int fd, BYTE *data, size_t n, LONG pos ) {
+    while( n ) {
+        ssize_t got = pread( fd, data, n, pos );
+        if( got < 0 && errno == EINTR ) {
+            continue;
+        }
+        if( got <= 0 ) {
+            return false;
+        }
+        data += got;
+        pos  += got;
+        n    -= got;
+    }
+    return true;
+}
+
+static bool
+pwrite_fully ( int fd, const BYTE *data, size_t n, LONG pos ) {
+    while( n ) {
+        ssize_t put = pwrite( fd, data, n, pos );
+        if( put < 0 && errno == EINTR ) {
+            continue;
+        }
+        if( put <= 0 ) {
+            return false;
+        }
+        data += put;
+        pos  += put;
+        n    -= put;
+    }
+    return true;
+}
+
+/* buffer for a row as it is stored in the file. Every thread patching an
+ * image has its own */
+static std::vector<BYTE> &
+row_buffer ( const PatchFile &patch ) {
+    static thread_local std::vector<BYTE> buffer;
+    buffer.resize( (size_t) patch.width * patch.depth );
+    return buffer;
+}
+
+/* position of a row of the image in the file */
+static LONG
+row_offset ( const PatchFile &patch, int row ) {
+    return patch.offset + patch.stride *
+        (patch.bottom_up? patch.height - 1 - row : row);
+}
+
+bool
+open_patch ( PatchFile &patch, const char *filename, bool writable ) {
+    BYTE header[BMP_HEADER_SIZE];
+    struct stat st;
+
+    patch.fd = open( filename, writable? O_RDWR : O_RDONLY );
+    if( patch.fd < 0 ) {
+        return false;
+    }
+
+    if( fstat( patch.fd, &st ) < 0 || !S_ISREG( st.st_mode ) ||
+            !pread_fully( patch.fd, header, sizeof(header), 0 ) ||
+            header[0] != 'B' || header[1] != 'M' ) {
+        close_patch( patch );
+        return false;
+    }
+
+    /* CImg reads 24 and 32 bit images itself, but hands compressed images
+     * (including 32 bit images with bit fields) off to another program */
+    LONG offset      = read_le( header + 0x0A, 4 );
+    LONG header_size = read_le( header + 0x0E, 4 );
+    int  width       = (int32_t) read_le( header + 0x12, 4 );
+    int  height      = (int32_t) read_le( header + 0x16, 4 );
+    int  bpp         = read_le( header + 0x1C, 2 );
+    int  compression = read_le( header + 0x1E, 4 );
+
+    if( (bpp != 24 && bpp != 32) || compression || width <= 0 ||
+            height == 0 || height == INT_MIN ||
+            offset < BMP_FILE_HEADER_SIZE + header_size ) {
+        close_patch( patch );
+        return false;
+    }
+
+    patch.width     = width;
+    patch.height    = (height < 0)? -height : height;
+    patch.spectrum  = 3;
+    patch.depth     = bpp / BYTES_TO_BITS(1);
+    patch.stride    = ((LONG) width * patch.depth + 3) / 4 * 4;
+    patch.offset    = offset;
+    patch.bottom_up = (height > 0);
+
+    /* every row must be all there */
+    if( patch.offset + patch.stride * (patch.height - 1) +
+            (LONG) width * patch.depth > (LONG) st.st_size ) {
+        close_patch( patch );
+        return false;
+    }
+    return true;
+}
+
+/* extension of a filename, without the dot */
+static const char *
+extension ( const char *filename ) {
+    const char *dot = std::strrchr( filename, '.' );
+    return (dot && !std::strchr( dot, '/' ))? dot + 1 : "";
+}
+
+bool
+patch_matches ( const PatchFile &patch, const char *filename ) {
+    return !strcasecmp( extension( filename ), "bmp" );
+}
+
+bool
+read_patch_row ( const PatchFile &patch, int row, CHANNEL *data ) {
+    std::vector<BYTE> &buffer = row_buffer( patch );
+
+    if( !pread_fully( patch.fd, buffer.data(), buffer.size(),
+                row_offset( patch, row ) ) ) {
+        return false;
+    }
+
+    /* pixels are stored blue first, followed by any fourth byte */
+    const BYTE *p = buffer.data();
+    for( int x=0; x<patch.width; x++, p+=patch.depth, data+=3 ) {
+        data[0] = p[2];
+        data[1] = p[1];
+        data[2] = p[0];
+    }
+    return true;
+}
+
+bool
+write_patch_row ( const PatchFile &patch, int row, const CHANNEL *data ) {
+    std::vector<BYTE> &buffer = row_buffer( patch );
+    LONG pos = row_offset( patch, row );
+
+    /* the fourth byte of each pixel has to be preserved */
+    if( patch.depth > 3 &&
+            !pread_fully( patch.fd, buffer.data(), buffer.size(), pos ) ) {
+        return false;
+    }
+
+    BYTE *p = buffer.data();
+    for( int x=0; x<patch.width; x++, p+=patch.depth, data+=3 ) {
+        p[2] = data[0];
+        p[1] = data[1];
+        p[0] = data[2];
+    }
+    return pwrite_fully( patch.fd, buffer.data(), buffer.size(), pos );
+}
+
+bool
+close_patch ( PatchFile &patch ) {
+    bool ok = true;
+
+    if( patch.fd >= 0 ) {
+        ok = (close( patch.fd ) == 0);
+        patch.fd = -1;
+    }
+    return ok;
+}
@@ -0,0 +1,42 @@
+#ifndef PATCH_H
+#define PATCH_H
+
+#include "steg.h"
+
+/* an uncompressed 24 or 32 bit BMP image whose rows are read, and rewritten,
+ * where they lie in the file. Only the rows that hold embedded data are ever
+ * touched, so working on a small file hidden in a huge image costs no more
+ * than the rows it occupies. Rows are handed out top to bottom with their
+ * channels in RGB order, as CImg loads them */
+struct PatchFile {
+    int  fd = -1;
+    int  width;
+    int  height;
+    int  spectrum;
+    LONG offset;     /* position of the pixel data in the file */
+    LONG stride;     /* bytes from the start of one row to the next */
+    int  depth;      /* bytes per pixel in the file */
+    bool bottom_up;  /* rows are stored from the bottom of the image up */
+};
+
+/* open an image to be patched, for reading only or for reading and writing.
+ * Returns false if the image cannot be opened or is not in a format that
+ * can be patched, in which case it should be loaded in the usual way */
+bool open_patch ( PatchFile &patch, const char *filename, bool writable );
+
+/* true if an image written under filename would be saved in the same format
+ * as the image being patched */
+bool patch_matches ( const PatchFile &patch, const char *filename );
+
+/* read a row of the image into a buffer of width*spectrum channels */
+bool read_patch_row ( const PatchFile &patch, int row, CHANNEL *data );
+
+/* rewrite a row of the image from a buffer of width*spectrum channels. Any
+ * bytes of the row which aren't channels are left as they are */
+bool write_patch_row ( const PatchFile &patch, int row, const CHANNEL *data );
+
+/* release the resources held by a patched image. Returns false if any of
+ * the changes failed to make it to the file */
+bool close_patch ( PatchFile &patch );
+
+#endif
@@ -0,0 +1,121 @@
+#include "pool.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <vector>
+
+/* state shared between the workers and the thread handing out tasks. The
+ * workers are stopped and joined when the program exits */
+static struct Pool {
+    std::vector<std::thread> threads;
+    std::mutex               lock;
+    std::condition_variable  wake;     /* signalled when tasks are posted */
+    std::condition_variable  done;     /* signalled when the last finishes */
+
+    const std::function<void(int)> *task;
+    int                      count;    /* number of tasks in the job */
+    int                      next;     /* next task to be handed out */
+    int                      finished; /* number of tasks completed */
+    unsigned                 job;      /* bumped every time tasks are posted */
+    bool                     stop;
+    std::exception_ptr       error;    /* first exception thrown by a task */
+
+    ~Pool() {
+        {
+            std::lock_guard<std::mutex> guard( lock );
+            stop = true;
+        }
+        wake.notify_all();
+        for( size_t i=0; i<threads.size(); i++ ) {
+            threads[i].join();
+        }
+    }
+} g_pool;
+
+/* take tasks from the current job and run them until there are none left.
+ * Must be called with the lock held, which is released while tasks run */
+static void
+work ( std::unique_lock<std::mutex> &guard ) {
+    while( g_pool.next < g_pool.count ) {
+        int i = g_pool.next++;
+        const std::function<void(int)> &task = *g_pool.task;
+
+        guard.unlock();
+        std::exception_ptr error;
+        try {
+            task( i );
+        } catch ( ... ) {
+            error = std::current_exception();
+        }
+        guard.lock();
+
+        if( error && !g_pool.error ) {
+            g_pool.error = error;
+        }
+        if( ++g_pool.finished == g_pool.count ) {
+            g_pool.done.notify_all();
+        }
+    }
+}
+
+static void
+worker () {
+    std::unique_lock<std::mutex> guard( g_pool.lock );
+    unsigned seen = g_pool.job;
+
+    for( ;; ) {
+        g_pool.wake.wait( guard, [&seen] { 
+                return g_pool.stop || g_pool.job != seen; } );
+        if( g_pool.stop ) {
+            return;
+        }
+        seen = g_pool.job;
+        work( guard );
+    }
+}
+
+void
+start_workers ( int threads ) {
+    g_pool.count    = 0;
+    g_pool.next     = 0;
+    g_pool.finished = 0;
+    g_pool.job      = 0;
+    g_pool.stop     = false;
+
+    for( int i=1; i<threads; i++ ) {
+        g_pool.threads.push_back( std::thread( worker ) );
+    }
+}
+
+int
+worker_count () {
+    return g_pool.threads.size() + 1;
+}
+
+void
+run_parallel ( int count, const std::function<void(int)> &task ) {
+    std::unique_lock<std::mutex> guard( g_pool.lock );
+
+    g_pool.task     = &task;
+    g_pool.count    = count;
+    g_pool.next     = 0;
+    g_pool.finished = 0;
+    g_pool.error    = std::exception_ptr();
+    g_pool.job++;
+    g_pool.wake.notify_all();
+
+    work( guard );
+    g_pool.done.wait( guard, [] { return g_pool.finished == g_pool.count; } );
+
+    /* drop the job so that late waking workers find nothing to do */
+    g_pool.count = 0;
+    g_pool.next  = 0;
+
+    if( g_pool.error ) {
+        std::exception_ptr error = g_pool.error;
+        g_pool.error = std::exception_ptr();
+        guard.unlock();
+        std::rethrow_exception( error );
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <functional>
+
+/* start a pool of worker threads. The thread which calls run_parallel() also
+ * takes part in the work, so a pool of threads-1 workers is started in
+ * order to use threads threads in total */
+void start_workers ( int threads );
+
+/* number of threads taking part in parallel work, including the caller */
+int worker_count ();
+
+/* run task(0) through task(count-1) across the worker pool and the calling
+ * thread, returning once all of them have finished. If any task throws, the
+ * first exception is rethrown here once the others have finished */
+void run_parallel ( int count, const std::function<void(int)> &task );
+
+#endif
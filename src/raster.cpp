@@ -0,0 +1,206 @@
+#include "raster.h"
+#include <cstring>
+#include <cctype>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/* reads the header at the start of a mapped image */
+struct HeaderParser {
+    const BYTE *p;
+    const BYTE *end;
+};
+
+/* skip whitespace and comments in a PNM header */
+static void
+skip_space ( HeaderParser &hp ) {
+    while( hp.p < hp.end && (std::isspace( *hp.p ) || *hp.p == '#') ) {
+        if( *hp.p == '#' ) {
+            while( hp.p < hp.end && *hp.p != '\n' ) {
+                hp.p++;
+            }
+        } else {
+            hp.p++;
+        }
+    }
+}
+
+/* read the next whitespace separated number from a PNM header */
+static bool
+parse_value ( HeaderParser &hp, int &value ) {
+    skip_space( hp );
+    if( hp.p == hp.end || !std::isdigit( *hp.p ) ) {
+        return false;
+    }
+    for( value = 0; hp.p < hp.end && std::isdigit( *hp.p ); hp.p++ ) {
+        if( value > (INT_MAX - 9) / 10 ) {
+            return false;
+        }
+        value = value * 10 + (*hp.p - '0');
+    }
+    return true;
+}
+
+/* read the next whitespace separated word from a PAM header */
+static bool
+parse_token ( HeaderParser &hp, char *token, size_t size ) {
+    size_t n = 0;
+
+    skip_space( hp );
+    while( hp.p < hp.end && !std::isspace( *hp.p ) ) {
+        if( n + 1 == size ) {
+            return false;
+        }
+        token[n++] = *hp.p++;
+    }
+    token[n] = '\0';
+    return n > 0;
+}
+
+/* PPM/PGM: the width, height and largest sample value follow the magic
+ * number, and a single whitespace character ends the header */
+static bool
+parse_pnm ( HeaderParser &hp, Raster &raster, int &maxval ) {
+    raster.spectrum = (raster.magic == '5')? 1 : 3;
+    return parse_value( hp, raster.width ) &&
+        parse_value( hp, raster.height ) &&
+        parse_value( hp, maxval ) &&
+        hp.p < hp.end && std::isspace( *hp.p++ );
+}
+
+/* PAM: the header is a list of named fields ending with ENDHDR on a line of
+ * its own. The tuple type says nothing about how the samples are laid out,
+ * so it is ignored */
+static bool
+parse_pam ( HeaderParser &hp, Raster &raster, int &maxval ) {
+    char token[16];
+
+    raster.width = raster.height = raster.spectrum = maxval = 0;
+    while( parse_token( hp, token, sizeof(token) ) ) {
+        int *field = NULL;
+
+        if( !strcmp( token, "ENDHDR" ) ) {
+            while( hp.p < hp.end && *hp.p != '\n' ) {
+                hp.p++;
+            }
+            return hp.p++ < hp.end;
+        } 
+        
+        if( !strcmp( token, "TUPLTYPE" ) ) {
+            while( hp.p < hp.end && *hp.p != '\n' ) {
+                hp.p++;
+            }
+            continue;
+        }
+
+        if( !strcmp( token, "WIDTH" ) ) {
+            field = &raster.width;
+        } else if( !strcmp( token, "HEIGHT" ) ) {
+            field = &raster.height;
+        } else if( !strcmp( token, "DEPTH" ) ) {
+            field = &raster.spectrum;
+        } else if( !strcmp( token, "MAXVAL" ) ) {
+            field = &maxval;
+        }
+        if( !field || !parse_value( hp, *field ) ) {
+            return false;
+        }
+    }
+    return false;
+}
+
+bool
+open_raster ( Raster &raster, const char *filename, bool writable ) {
+    struct stat st;
+
+    raster.map      = NULL;
+    raster.writable = writable;
+    raster.fd = open( filename, writable? O_RDWR : O_RDONLY );
+    if( raster.fd < 0 ) {
+        return false;
+    }
+
+    if( fstat( raster.fd, &st ) < 0 || !S_ISREG( st.st_mode ) ||
+            st.st_size < 3 ) {
+        close_raster( raster );
+        return false;
+    }
+
+    raster.length = st.st_size;
+    void *map = mmap( NULL, raster.length,
+            writable? PROT_READ | PROT_WRITE : PROT_READ,
+            writable? MAP_SHARED : MAP_PRIVATE, raster.fd, 0 );
+    if( map == MAP_FAILED ) {
+        close_raster( raster );
+        return false;
+    }
+    raster.map = (BYTE *) map;
+
+    HeaderParser hp = { raster.map, raster.map + raster.length };
+    int maxval;
+    bool parsed = false;
+
+    if( hp.p[0] == 'P' ) {
+        raster.magic = hp.p[1];
+        hp.p += 2;
+        if( raster.magic == '5' || raster.magic == '6' ) {
+            parsed = parse_pnm( hp, raster, maxval );
+        } else if( raster.magic == '7' ) {
+            parsed = parse_pam( hp, raster, maxval );
+        }
+    }
+
+    /* the raster must be all there, with samples a byte wide */
+    if( !parsed || maxval != UCHAR_MAX || raster.width <= 0 ||
+            raster.height <= 0 || raster.spectrum <= 0 ||
+            (LONG) raster.width * raster.height * raster.spectrum >
+            (LONG) (hp.end - hp.p) ) {
+        close_raster( raster );
+        return false;
+    }
+
+    raster.data = (CHANNEL *) hp.p;
+    madvise( map, raster.length, MADV_SEQUENTIAL );
+    return true;
+}
+
+/* extension of a filename, without the dot */
+static const char *
+extension ( const char *filename ) {
+    const char *dot = std::strrchr( filename, '.' );
+    return (dot && !std::strchr( dot, '/' ))? dot + 1 : "";
+}
+
+bool
+raster_matches ( const Raster &raster, const char *filename ) {
+    const char *ext = extension( filename );
+
+    /* PPM/PGM images are saved with the magic number that suits the number
+     * of channels, whichever of the extensions is used */
+    if( raster.magic == '7' ) {
+        return !strcasecmp( ext, "pam" );
+    }
+    return !strcasecmp( ext, "ppm" ) || !strcasecmp( ext, "pgm" ) ||
+        !strcasecmp( ext, "pnm" );
+}
+
+bool
+close_raster ( Raster &raster ) {
+    bool ok = true;
+
+    if( raster.map ) {
+        if( raster.writable &&
+                msync( raster.map, raster.length, MS_SYNC ) < 0 ) {
+            ok = false;
+        }
+        munmap( raster.map, raster.length );
+        raster.map = NULL;
+    }
+    if( raster.fd >= 0 ) {
+        ok = (close( raster.fd ) == 0) && ok;
+        raster.fd = -1;
+    }
+    return ok;
+}
@@ -0,0 +1,38 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include "steg.h"
+#include <cstddef>
+
+/* a binary PPM/PGM or PAM image mapped straight into memory. The raster of
+ * such an image holds the channels of each pixel next to one another, which
+ * is exactly the order file data is embedded in, so data can be embedded in
+ * the mapping itself with no decoding or encoding of the image at all. Only
+ * images with 8 bit samples using the full range of a byte are supported, as
+ * anything else would need its header rewriting once data was embedded */
+struct Raster {
+    int      fd  = -1;
+    BYTE    *map = NULL;
+    size_t   length;     /* size of the mapping */
+    CHANNEL *data;       /* first channel of the first pixel */
+    int      width;
+    int      height;
+    int      spectrum;
+    char     magic;      /* format of the image, '5', '6' or '7' */
+    bool     writable;   /* changes to the mapping go back to the file */
+};
+
+/* map an image into memory, for reading only or for reading and writing.
+ * Returns false if the image cannot be opened or is not in a format that
+ * can be mapped, in which case it should be loaded in the usual way */
+bool open_raster ( Raster &raster, const char *filename, bool writable );
+
+/* true if an image written under filename would be saved in the same format
+ * as the raster, so that the mapped file can stand in for it */
+bool raster_matches ( const Raster &raster, const char *filename );
+
+/* unmap an image, first writing any changes back to the file. Returns false
+ * if the changes could not be written */
+bool close_raster ( Raster &raster );
+
+#endif
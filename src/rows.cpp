@@ -0,0 +1,315 @@
+#include "rows.h"
+#include <cstring>
+#include <cctype>
+#include <strings.h>
+
+/* read the next whitespace separated number from a PNM header, skipping any
+ * comments along the way */
+static bool
+read_pnm_value ( std::FILE *file, int &value ) {
+    int c = std::fgetc( file );
+
+    while( c != EOF && (std::isspace( c ) || c == '#') ) {
+        if( c == '#' ) {
+            while( c != EOF && c != '\n' ) {
+                c = std::fgetc( file );
+            }
+        }
+        c = std::fgetc( file );
+    }
+
+    if( c == EOF || !std::isdigit( c ) ) {
+        return false;
+    }
+
+    for( value = 0; c != EOF && std::isdigit( c ); c = std::fgetc( file ) ) {
+        value = value * 10 + (c - '0');
+    }
+
+    /* exactly one whitespace character separates the header from the
+     * image data, so the character which ended the number is consumed */
+    return c != EOF && std::isspace( c );
+}
+
+static bool
+open_pnm ( RowReader &rows ) {
+    char magic[2];
+    int  maxval;
+
+    if( std::fread( magic, 1, 2, rows.file ) != 2 || magic[0] != 'P' ||
+            (magic[1] != '5' && magic[1] != '6') ) {
+        return false;
+    }
+
+    if( !read_pnm_value( rows.file, rows.width ) || 
+            !read_pnm_value( rows.file, rows.height ) ||
+            !read_pnm_value( rows.file, maxval ) ) {
+        return false;
+    }
+
+    /* samples wider than a byte are stored in two bytes each */
+    if( maxval <= 0 || maxval > UCHAR_MAX ) {
+        return false;
+    }
+
+    rows.spectrum = (magic[1] == '5')? 1 : 3;
+    return true;
+}
+
+#ifdef cimg_use_png
+static bool
+open_png ( RowReader &rows ) {
+    png_byte sig[8];
+
+    if( std::fread( sig, 1, sizeof(sig), rows.file ) != sizeof(sig) ||
+            png_sig_cmp( sig, 0, sizeof(sig) ) ) {
+        return false;
+    }
+
+    rows.png = png_create_read_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, 
+            NULL );
+    if( !rows.png ) {
+        return false;
+    }
+    rows.info = png_create_info_struct( rows.png );
+    if( !rows.info || setjmp( png_jmpbuf( rows.png ) ) ) {
+        return false;
+    }
+
+    png_init_io( rows.png, rows.file );
+    png_set_sig_bytes( rows.png, sizeof(sig) );
+    png_read_info( rows.png, rows.info );
+
+    png_uint_32 w, h;
+    int depth, colour, interlace;
+    png_get_IHDR( rows.png, rows.info, &w, &h, &depth, &colour, &interlace,
+            NULL, NULL );
+
+    /* interlaced images need every pass before a row is complete, and CImg
+     * keeps 16 bit samples in a form we can't reproduce from the rows */
+    if( interlace != PNG_INTERLACE_NONE || depth == 16 ) {
+        return false;
+    }
+
+    /* apply the same transformations CImg does, minus the expansion of grey
+     * to RGB and the filler it adds to every pixel, which it discards */
+    if( colour == PNG_COLOR_TYPE_PALETTE ) {
+        png_set_palette_to_rgb( rows.png );
+    }
+    if( colour == PNG_COLOR_TYPE_GRAY && depth < 8 ) {
+        png_set_expand_gray_1_2_4_to_8( rows.png );
+    }
+    if( png_get_valid( rows.png, rows.info, PNG_INFO_tRNS ) ) {
+        png_set_tRNS_to_alpha( rows.png );
+    }
+    png_read_update_info( rows.png, rows.info );
+
+    rows.width    = w;
+    rows.height   = h;
+    rows.spectrum = png_get_channels( rows.png, rows.info );
+    return png_get_bit_depth( rows.png, rows.info ) == 8;
+}
+#endif
+
+bool
+open_rows ( RowReader &rows, const char *filename ) {
+    rows.row = 0;
+#ifdef cimg_use_png
+    rows.png  = NULL;
+    rows.info = NULL;
+#endif
+
+    rows.file = std::fopen( filename, "rb" );
+    if( !rows.file ) {
+        return false;
+    }
+
+    if( open_pnm( rows ) ) {
+        return true;
+    }
+
+#ifdef cimg_use_png
+    std::rewind( rows.file );
+    if( open_png( rows ) ) {
+        return true;
+    }
+#endif
+
+    close_rows( rows );
+    return false;
+}
+
+bool
+read_row ( RowReader &rows, CHANNEL *row ) {
+    if( rows.row >= rows.height ) {
+        return false;
+    }
+
+#ifdef cimg_use_png
+    if( rows.png ) {
+        if( setjmp( png_jmpbuf( rows.png ) ) ) {
+            return false;
+        }
+        png_read_row( rows.png, row, NULL );
+        rows.row++;
+        return true;
+    }
+#endif
+
+    size_t len = (size_t) rows.width * rows.spectrum;
+    if( std::fread( row, 1, len, rows.file ) != len ) {
+        return false;
+    }
+    rows.row++;
+    return true;
+}
+
+void
+close_rows ( RowReader &rows ) {
+#ifdef cimg_use_png
+    if( rows.png ) {
+        png_destroy_read_struct( &rows.png, rows.info? &rows.info : NULL, 
+                NULL );
+    }
+#endif
+    if( rows.file ) {
+        std::fclose( rows.file );
+        rows.file = NULL;
+    }
+}
+
+/* extension of a filename, without the dot */
+static const char *
+extension ( const char *filename ) {
+    const char *dot = std::strrchr( filename, '.' );
+    return (dot && !std::strchr( dot, '/' ))? dot + 1 : "";
+}
+
+static bool
+create_pnm ( RowWriter &rows ) {
+    /* like CImg, the magic number follows the number of channels rather
+     * than the extension */
+    if( rows.spectrum != 1 && rows.spectrum != 3 ) {
+        return false;
+    }
+
+    return std::fprintf( rows.file, "P%c\n%d %d\n255\n", 
+            (rows.spectrum == 1)? '5' : '6', rows.width, rows.height ) > 0;
+}
+
+#ifdef cimg_use_png
+static bool
+create_png ( RowWriter &rows ) {
+    static const int colour[] = { PNG_COLOR_TYPE_GRAY, 
+        PNG_COLOR_TYPE_GRAY_ALPHA, PNG_COLOR_TYPE_RGB, 
+        PNG_COLOR_TYPE_RGB_ALPHA };
+
+    if( rows.spectrum < 1 || rows.spectrum > 4 ) {
+        return false;
+    }
+
+    rows.png = png_create_write_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, 
+            NULL );
+    if( !rows.png ) {
+        return false;
+    }
+    rows.info = png_create_info_struct( rows.png );
+    if( !rows.info || setjmp( png_jmpbuf( rows.png ) ) ) {
+        return false;
+    }
+
+    png_init_io( rows.png, rows.file );
+    png_set_IHDR( rows.png, rows.info, rows.width, rows.height, 8, 
+            colour[rows.spectrum - 1], PNG_INTERLACE_NONE, 
+            PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT );
+    png_write_info( rows.png, rows.info );
+    return true;
+}
+#endif
+
+bool
+create_rows ( RowWriter &rows, const char *filename, int width, int height,
+        int spectrum ) {
+    const char *ext = extension( filename );
+    bool png = !strcasecmp( ext, "png" );
+
+    rows.width    = width;
+    rows.height   = height;
+    rows.spectrum = spectrum;
+    rows.row      = 0;
+    rows.file     = NULL;
+#ifdef cimg_use_png
+    rows.png      = NULL;
+    rows.info     = NULL;
+#else
+    if( png ) {
+        return false;
+    }
+#endif
+
+    if( !png && strcasecmp( ext, "ppm" ) && strcasecmp( ext, "pgm" ) &&
+            strcasecmp( ext, "pnm" ) ) {
+        return false;
+    }
+
+    rows.file = std::fopen( filename, "wb" );
+    if( !rows.file ) {
+        return false;
+    }
+
+#ifdef cimg_use_png
+    if( png? create_png( rows ) : create_pnm( rows ) ) {
+        return true;
+    }
+#else
+    if( create_pnm( rows ) ) {
+        return true;
+    }
+#endif
+
+    close_rows( rows );
+    std::remove( filename );
+    return false;
+}
+
+bool
+write_row ( RowWriter &rows, const CHANNEL *row ) {
+#ifdef cimg_use_png
+    if( rows.png ) {
+        if( setjmp( png_jmpbuf( rows.png ) ) ) {
+            return false;
+        }
+        png_write_row( rows.png, row );
+        rows.row++;
+        return true;
+    }
+#endif
+
+    size_t len = (size_t) rows.width * rows.spectrum;
+    if( std::fwrite( row, 1, len, rows.file ) != len ) {
+        return false;
+    }
+    rows.row++;
+    return true;
+}
+
+bool
+close_rows ( RowWriter &rows ) {
+    bool ok = (rows.row == rows.height);
+
+#ifdef cimg_use_png
+    if( rows.png ) {
+        if( ok && !setjmp( png_jmpbuf( rows.png ) ) ) {
+            png_write_end( rows.png, NULL );
+        } else {
+            ok = false;
+        }
+        png_destroy_write_struct( &rows.png, rows.info? &rows.info : NULL );
+    }
+#endif
+    if( rows.file ) {
+        ok = (std::fclose( rows.file ) == 0) && ok;
+        rows.file = NULL;
+    }
+    return ok;
+}
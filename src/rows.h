@@ -0,0 +1,66 @@
+#ifndef ROWS_H
+#define ROWS_H
+
+#include "steg.h"
+#include <cstdio>
+
+#ifdef cimg_use_png
+#include <png.h>
+#endif
+
+/* reads an image one row at a time, with the channels of each pixel stored
+ * next to one another. Only formats which can be decoded incrementally into
+ * exactly the channels CImg would produce are supported: binary PPM/PGM with
+ * 8 bit samples and, when built with libpng, non-interlaced 8 bit PNG */
+struct RowReader {
+    std::FILE *file = NULL;
+    int        width;
+    int        height;
+    int        spectrum;
+    int        row;      /* number of rows read so far */
+#ifdef cimg_use_png
+    png_structp png  = NULL; /* libpng state, or NULL for PPM/PGM */
+    png_infop   info = NULL;
+#endif
+};
+
+/* open an image for reading row by row. Returns false if the image cannot be
+ * opened or is not in a format that can be streamed, in which case it should
+ * be loaded in full instead */
+bool open_rows ( RowReader &rows, const char *filename );
+
+/* read the next row of the image into a buffer of width*spectrum channels.
+ * Returns false if the image data is truncated or corrupt */
+bool read_row ( RowReader &rows, CHANNEL *row );
+
+/* release the resources held by a reader */
+void close_rows ( RowReader &rows );
+
+/* writes an image one row at a time, in the same layout a RowReader reads
+ * them. The format is chosen from the extension of the filename, as CImg
+ * does: PNG when built with libpng, or binary PPM/PGM */
+struct RowWriter {
+    std::FILE *file = NULL;
+    int        width;
+    int        height;
+    int        spectrum;
+    int        row;      /* number of rows written so far */
+#ifdef cimg_use_png
+    png_structp png  = NULL; /* libpng state, or NULL for PPM/PGM */
+    png_infop   info = NULL;
+#endif
+};
+
+/* create an image to be written row by row. Returns false if the image can't
+ * be created or its format can't hold the given number of channels */
+bool create_rows ( RowWriter &rows, const char *filename, int width, 
+        int height, int spectrum );
+
+/* write the next row of the image from a buffer of width*spectrum channels */
+bool write_row ( RowWriter &rows, const CHANNEL *row );
+
+/* finish writing an image once every row has been written and release the
+ * resources held by the writer */
+bool close_rows ( RowWriter &rows );
+
+#endif
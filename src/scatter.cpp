@@ -0,0 +1,105 @@
+#include "scatter.h"
+#include <algorithm>
+
+/* constants of Philox4x32 */
+#define PHILOX_M0               0xD2511F53
+#define PHILOX_M1               0xCD9E8D57
+#define PHILOX_W0               0x9E3779B9
+#define PHILOX_W1               0xBB67AE85
+#define PHILOX_ROUNDS           10
+
+#define FEISTEL_ROUNDS          4
+
+/* what a Philox counter is being used for */
+#define USE_SHUFFLE             1
+#define USE_ROTATION            2
+
+/* Philox4x32-10. The first two words of the scatter key are the Philox key,
+ * and the other two go into the counter alongside the value being hashed,
+ * the round it is for and what it is being used for. Returns the first word
+ * of the output */
+static uint32_t
+philox ( const Scatter &scatter, uint32_t value, uint32_t round,
+        uint32_t use ) {
+    uint32_t c[4] = { value, scatter.key[2], (use << 16) | round,
+        scatter.key[3] };
+    uint32_t k0 = scatter.key[0];
+    uint32_t k1 = scatter.key[1];
+
+    for( int i=0; i<PHILOX_ROUNDS; i++ ) {
+        uint64_t p0 = (uint64_t) PHILOX_M0 * c[0];
+        uint64_t p1 = (uint64_t) PHILOX_M1 * c[2];
+        uint32_t n[4] = {
+            (uint32_t) (p1 >> 32) ^ c[1] ^ k0, (uint32_t) p1,
+            (uint32_t) (p0 >> 32) ^ c[3] ^ k1, (uint32_t) p0
+        };
+        c[0] = n[0]; c[1] = n[1]; c[2] = n[2]; c[3] = n[3];
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    return c[0];
+}
+
+/* a keyed permutation of the numbers below 1 << (2*half) */
+static uint32_t
+feistel ( const Scatter &scatter, uint32_t x, int half ) {
+    uint32_t mask = (1u << half) - 1;
+    uint32_t l = x >> half;
+    uint32_t r = x & mask;
+
+    for( int i=0; i<FEISTEL_ROUNDS; i++ ) {
+        uint32_t t = l ^ (philox( scatter, r, i, USE_SHUFFLE ) & mask);
+        l = r;
+        r = t;
+    }
+    return (l << half) | r;
+}
+
+LONG
+scatter_pixels ( LONG pixels, LONG first ) {
+    LONG n = (pixels > first)? pixels - first : 0;
+    return (n < SCATTER_REGION_PIXELS)? n : n - n % SCATTER_REGION_PIXELS;
+}
+
+void
+init_scatter ( Scatter &scatter, const BYTE *key, LONG pixels,
+        int spectrum, LONG first ) {
+    for( int i=0; i<4; i++ ) {
+        scatter.key[i] = (uint32_t) key[4*i] << 24 | key[4*i+1] << 16 |
+            key[4*i+2] << 8 | key[4*i+3];
+    }
+
+    LONG n = scatter_pixels( pixels, first );
+    scatter.first    = first;
+    scatter.region   = std::min( n, (LONG) SCATTER_REGION_PIXELS );
+    scatter.regions  = scatter.region? n / scatter.region : 0;
+    scatter.spectrum = spectrum;
+    scatter.channels = scatter.region * spectrum;
+
+    /* the Feistel network permutes a range which is a power of four, so any
+     * result beyond the end of the region is put through it again until it
+     * lands in the region. The range is less than four times the size of
+     * the region, so this doesn't go on for long */
+    int half = 0;
+    while( ((LONG) 1 << (2*half)) < scatter.channels ) {
+        half++;
+    }
+
+    scatter.pixel.resize( scatter.channels );
+    scatter.channel.resize( scatter.channels );
+    for( LONG i=0; i<scatter.channels; i++ ) {
+        uint32_t slot = i;
+        do {
+            slot = feistel( scatter, slot, half );
+        } while( slot >= scatter.channels );
+
+        scatter.pixel[i]   = slot / spectrum;
+        scatter.channel[i] = slot % spectrum;
+    }
+}
+
+LONG
+region_rotation ( const Scatter &scatter, LONG region ) {
+    return philox( scatter, region, 0, USE_ROTATION ) %
+        scatter.channels;
+}
@@ -0,0 +1,46 @@
+#ifndef SCATTER_H
+#define SCATTER_H
+
+#include "steg.h"
+#include <vector>
+
+/* a keyed shuffle of the channels which hold file data, so that the data is
+ * spread over the whole image in an order which can't be followed without
+ * the key. The pixels after the header are divided into regions of
+ * SCATTER_REGION_PIXELS pixels. Successive channels' worth of data go to
+ * successive regions in turn, so however small the file it is spread evenly
+ * over the image, and the data given to each region is shuffled within it.
+ * The shuffle is a permutation built from a Feistel network with the Philox
+ * counter-based generator as its round function, rotated by a different
+ * keyed amount in each region. The channel holding any part of the data can
+ * therefore be found without regard to any other part, and the data can be
+ * embedded a region at a time, in any order or in parallel, so that the
+ * channels being changed are always close together in memory */
+#define SCATTER_REGION_PIXELS   1024
+#define SCATTER_KEY_BYTES       32
+
+struct Scatter {
+    LONG first;        /* pixel at which the first region starts */
+    LONG regions;      /* number of regions */
+    LONG region;       /* number of pixels in each region */
+    int  spectrum;
+    LONG channels;     /* number of channels in each region */
+    std::vector<uint32_t> pixel;   /* pixel within a region of each slot */
+    std::vector<uint8_t>  channel; /* channel within that pixel */
+    uint32_t key[4];
+};
+
+/* number of the pixels from the first onward which data is scattered over.
+ * Any pixels beyond the last whole region are left alone, unless there is
+ * less than a region to begin with */
+LONG scatter_pixels ( LONG pixels, LONG first );
+
+/* set up the shuffle for an image with the given number of pixels and
+ * channels per pixel, with data scattered from the first pixel on */
+void init_scatter ( Scatter &scatter, const BYTE *key, LONG pixels,
+        int spectrum, LONG first );
+
+/* amount by which the shuffle is rotated in a region */
+LONG region_rotation ( const Scatter &scatter, LONG region );
+
+#endif
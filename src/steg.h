@@ -0,0 +1,88 @@
+#ifndef STEG_H
+#define STEG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <climits>
+
+/* some helpful macros for determining things like the number of pixel channels
+ * required to encode a unit of information or masks for clearing/setting bits
+ * during encoding/retrieval */
+#define BYTES_TO_BITS(x)        ((x) * CHAR_BIT)
+#define NUM_CHANNEL_BITS        BYTES_TO_BITS(sizeof(CHANNEL))
+#define ENCODE_BITS_PER_CHANNEL 2
+#define CHANNEL_BIT_MASK        ((((uint64_t) 1) << ENCODE_BITS_PER_CHANNEL)-1)
+#define CHANNELS_TO_ENCODE(x)   ( BYTES_TO_BITS((x))/ENCODE_BITS_PER_CHANNEL )
+
+/* file data may instead be stored at anything from 1 to 8 bits per channel.
+ * It is packed in groups of whole bytes that fill a whole number of channels:
+ * a single byte at 1, 2, 4 or 8 bits per channel, but 3 bytes spread over 8
+ * channels at 3 bits per channel and so on. The header is always stored at
+ * ENCODE_BITS_PER_CHANNEL so that it can be found without knowing this */
+#define MIN_BITS_PER_CHANNEL    1
+#define MAX_BITS_PER_CHANNEL    8
+#define BITS_MASK(b)            ((((uint64_t) 1) << (b))-1)
+#define GROUP_BYTES(b)          ( (b)/((b) & -(b)) )
+#define GROUP_CHANNELS(b)       ( BYTES_TO_BITS(1)/((b) & -(b)) )
+#define CHANNELS_AT_BITS(x,b)   ( (BYTES_TO_BITS((x)) + (b) - 1)/(b) )
+
+typedef uint8_t  BYTE;    /* 8 bit unsigned integer */
+typedef uint64_t LONG;    /* 64 bit unsigned integer */
+typedef char     CHAR;    /* single string character */
+typedef uint8_t  CHANNEL; /* pixel unit - a single colour channel */
+
+/* embed a run of bytes in the consecutive channels starting at dst, or
+ * retrieve them again. These point at the fastest implementation the CPU
+ * supports once init_kernels() has been called */
+extern void (*pack_bytes)   ( CHANNEL *dst, const BYTE *src, size_t n );
+extern void (*unpack_bytes) ( BYTE *dst, const CHANNEL *src, size_t n );
+
+/* embed n whole groups of bytes in the consecutive channels starting at dst
+ * at BITS bits per channel, or retrieve them again. Instantiated for every
+ * supported number of bits, with 2 bits handed to the kernels above */
+template <int BITS> 
+void pack_groups   ( CHANNEL *dst, const BYTE *src, size_t n );
+template <int BITS> 
+void unpack_groups ( BYTE *dst, const CHANNEL *src, size_t n );
+
+template <> void pack_groups<2>   ( CHANNEL *dst, const BYTE *src, size_t n );
+template <> void unpack_groups<2> ( BYTE *dst, const CHANNEL *src, size_t n );
+
+/* files may instead be matrix encoded, hiding K bits of file data in the
+ * least significant bits of each block of MATRIX_CHANNELS(K) channels while
+ * changing at most one of them. The K bits are the syndrome of the block
+ * under a Hamming code: the exclusive or of the positions, counting from 1,
+ * of the channels in the block whose least significant bit is set */
+#define MIN_MATRIX_BITS         2
+#define MAX_MATRIX_BITS         8
+#define MATRIX_CHANNELS(k)      ( (1 << (k)) - 1 )
+
+/* syndrome of the block of n channels starting at src. Points at the fastest
+ * implementation the CPU supports once init_kernels() has been called */
+extern uint32_t (*syndrome) ( const CHANNEL *src, size_t n );
+
+/* CRC32C of a run of bytes, continuing from the CRC of the bytes before it.
+ * A CRC of 0 starts afresh */
+extern uint32_t (*crc32c) ( uint32_t crc, const BYTE *data, size_t n );
+
+/* arithmetic in GF(2^8), the field over which the Reed-Solomon codes that
+ * protect sharded files work. Valid once init_kernels() has been called */
+BYTE gf_mul ( BYTE a, BYTE b );
+BYTE gf_inv ( BYTE a );
+
+/* add c times the run of n bytes at src to the run at dst, in GF(2^8).
+ * Points at the fastest implementation the CPU supports once init_kernels()
+ * has been called */
+extern void (*gf_mul_add) ( BYTE *dst, const BYTE *src, BYTE c, size_t n );
+
+/* set each of the n channels at dst to table[min(|a - b|, 15)], where a and
+ * b are the channels in the same place in two images. Points at the fastest
+ * implementation the CPU supports once init_kernels() has been called */
+extern void (*diff_channels) ( CHANNEL *dst, const CHANNEL *a, 
+        const CHANNEL *b, const CHANNEL table[16], size_t n );
+
+/* select the bit packing, syndrome, checksum, GF(2^8) and difference
+ * kernels to use based on the features of the CPU we are running on */
+void init_kernels ();
+
+#endif